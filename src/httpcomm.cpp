@@ -0,0 +1,429 @@
+//
+//  Copyright (c) 2016 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44sbbd.
+//
+//  p44sbbd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44sbbd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44sbbd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "httpcomm.hpp"
+
+#include <sys/stat.h>
+
+#if !DISABLE_HTTPSERVER
+
+using namespace p44;
+
+#define HTTP_MAX_HEADER_SIZE 8192 // max size of request line plus headers
+#define HTTP_MAX_BODY_SIZE 65536 // max size of request body
+#define HTTP_MAX_BUFFERED (HTTP_MAX_HEADER_SIZE+HTTP_MAX_BODY_SIZE) // max amount of unprocessed (e.g. pipelined) request data
+#define HTTP_IDLE_TIMEOUT (30*Second) // keep-alive connections are closed after being idle that long
+#define HTTP_STATIC_MAXAGE 3600 // cache lifetime for static files, in seconds
+
+
+#pragma mark - utilities
+
+static string urlDecode(const string &aStr)
+{
+  string res;
+  for (size_t i=0; i<aStr.size(); i++) {
+    char c = aStr[i];
+    if (c=='+') {
+      res += ' ';
+    }
+    else if (c=='%' && i+2<aStr.size()) {
+      res += (char)strtol(aStr.substr(i+1, 2).c_str(), NULL, 16);
+      i += 2;
+    }
+    else {
+      res += c;
+    }
+  }
+  return res;
+}
+
+
+/// add name=value pairs from a query string or urlencoded form to a JSON object
+static void addUrlEncodedParams(JsonObjectPtr &aParams, const string &aEncoded)
+{
+  size_t i = 0;
+  while (i<aEncoded.size()) {
+    size_t e = aEncoded.find('&', i);
+    if (e==string::npos) e = aEncoded.size();
+    string pair = aEncoded.substr(i, e-i);
+    i = e+1;
+    if (pair.empty()) continue;
+    size_t eq = pair.find('=');
+    string name = urlDecode(pair.substr(0, eq));
+    string value = eq==string::npos ? "" : urlDecode(pair.substr(eq+1));
+    if (!aParams) aParams = JsonObject::newObj();
+    aParams->add(name.c_str(), JsonObject::newString(value));
+  }
+}
+
+
+static const char *statusText(int aStatus)
+{
+  switch (aStatus) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    default: return "Internal Server Error";
+  }
+}
+
+
+static const char *contentTypeFor(const string &aPath)
+{
+  size_t d = aPath.rfind('.');
+  if (d==string::npos) return "application/octet-stream";
+  string ext = aPath.substr(d+1);
+  if (ext=="html" || ext=="htm") return "text/html; charset=utf-8";
+  if (ext=="css") return "text/css";
+  if (ext=="js") return "application/javascript";
+  if (ext=="json") return "application/json";
+  if (ext=="png") return "image/png";
+  if (ext=="gif") return "image/gif";
+  if (ext=="jpg" || ext=="jpeg") return "image/jpeg";
+  if (ext=="svg") return "image/svg+xml";
+  if (ext=="ico") return "image/x-icon";
+  return "application/octet-stream";
+}
+
+
+#pragma mark - HttpComm
+
+HttpComm::HttpComm(MainLoop &aMainLoop) :
+  inherited(aMainLoop),
+  keepAlive(false),
+  answerPending(false),
+  closeWhenSent(false),
+  idleTicket(0),
+  processTicket(0)
+{
+  setReceiveHandler(boost::bind(&HttpComm::gotData, this, _1));
+}
+
+
+HttpComm::~HttpComm()
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(idleTicket);
+  MainLoop::currentMainLoop().cancelExecutionTicket(processTicket);
+}
+
+
+void HttpComm::setApiRequestHandler(const string &aApiPrefix, HttpApiRequestCB aApiRequestHandler)
+{
+  apiPrefix = aApiPrefix;
+  apiRequestHandler = aApiRequestHandler;
+}
+
+
+void HttpComm::gotData(ErrorPtr aError)
+{
+  if (Error::isOK(aError)) {
+    size_t dataSz = numBytesReady();
+    if (dataSz>0) {
+      uint8_t *buf = new uint8_t[dataSz];
+      size_t receivedBytes = receiveBytes(dataSz, buf, aError);
+      if (Error::isOK(aError)) {
+        receiveBuffer.append((const char *)buf, receivedBytes);
+      }
+      delete[] buf;
+    }
+  }
+  if (!Error::isOK(aError)) {
+    LOG(LOG_DEBUG, "HttpComm: error receiving data: %s", aError->description().c_str());
+    closeConnection();
+    return;
+  }
+  if (receiveBuffer.size()>HTTP_MAX_BUFFERED) {
+    // client sends more than we are willing to buffer (e.g. flood of pipelined requests)
+    LOG(LOG_WARNING, "HttpComm: too much unprocessed request data, closing connection");
+    receiveBuffer.clear();
+    keepAlive = false;
+    answerPending = false;
+    sendResponse(413, "text/plain", statusText(413));
+    return;
+  }
+  // connection is active, restart idle timeout
+  MainLoop::currentMainLoop().cancelExecutionTicket(idleTicket);
+  idleTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&HttpComm::idleTimeout, this), HTTP_IDLE_TIMEOUT);
+  processRequests();
+}
+
+
+void HttpComm::idleTimeout()
+{
+  idleTicket = 0;
+  LOG(LOG_DEBUG, "HttpComm: closing idle connection");
+  closeConnection();
+}
+
+
+void HttpComm::processRequests()
+{
+  // sending a response might close the connection and release the last reference to this object
+  HttpCommPtr keepMeAlive = HttpCommPtr(this);
+  // requests are processed strictly in order, one at a time
+  while (!answerPending && !closeWhenSent) {
+    size_t hdrEnd = receiveBuffer.find("\r\n\r\n");
+    if (hdrEnd==string::npos) {
+      if (receiveBuffer.size()>HTTP_MAX_HEADER_SIZE) {
+        keepAlive = false;
+        sendResponse(431, "text/plain", statusText(431));
+      }
+      return; // need more data
+    }
+    // - request line
+    size_t e = receiveBuffer.find("\r\n");
+    string requestLine = receiveBuffer.substr(0, e);
+    size_t s1 = requestLine.find(' ');
+    size_t s2 = s1==string::npos ? string::npos : requestLine.find(' ', s1+1);
+    if (s2==string::npos) {
+      keepAlive = false;
+      sendResponse(400, "text/plain", statusText(400));
+      return;
+    }
+    string method = requestLine.substr(0, s1);
+    string uri = requestLine.substr(s1+1, s2-s1-1);
+    string version = requestLine.substr(s2+1);
+    // - headers
+    size_t contentLength = 0;
+    string contentType;
+    string connection;
+    string transferEncoding;
+    size_t i = e+2;
+    while (i<hdrEnd) {
+      e = receiveBuffer.find("\r\n", i);
+      string line = receiveBuffer.substr(i, e-i);
+      i = e+2;
+      size_t c = line.find(':');
+      if (c==string::npos) continue;
+      string name = line.substr(0, c);
+      for (size_t k=0; k<name.size(); k++) name[k] = tolower(name[k]);
+      size_t v = line.find_first_not_of(" \t", c+1);
+      string value = v==string::npos ? "" : line.substr(v);
+      if (name=="content-length") contentLength = atol(value.c_str());
+      else if (name=="content-type") contentType = value;
+      else if (name=="transfer-encoding") transferEncoding = value;
+      else if (name=="connection") {
+        connection = value;
+        for (size_t k=0; k<connection.size(); k++) connection[k] = tolower(connection[k]);
+      }
+    }
+    if (!transferEncoding.empty() && transferEncoding!="identity") {
+      // chunked bodies are not supported, and we could not tell where the next request starts
+      keepAlive = false;
+      sendResponse(501, "text/plain", "Transfer-Encoding not supported");
+      return;
+    }
+    if (contentLength>HTTP_MAX_BODY_SIZE) {
+      keepAlive = false;
+      sendResponse(413, "text/plain", statusText(413));
+      return;
+    }
+    if (receiveBuffer.size()<hdrEnd+4+contentLength) return; // body not complete yet
+    string body = receiveBuffer.substr(hdrEnd+4, contentLength);
+    receiveBuffer.erase(0, hdrEnd+4+contentLength);
+    // HTTP/1.1 is persistent by default, HTTP/1.0 only on explicit request
+    if (version=="HTTP/1.1")
+      keepAlive = connection!="close";
+    else
+      keepAlive = connection=="keep-alive";
+    // - dispatch
+    size_t q = uri.find('?');
+    string path = urlDecode(uri.substr(0, q));
+    string query = q==string::npos ? "" : uri.substr(q+1);
+    LOG(LOG_INFO, "HTTP %s %s", method.c_str(), uri.c_str());
+    handleRequest(method, path, query, contentType, body);
+  }
+}
+
+
+void HttpComm::handleRequest(const string &aMethod, const string &aPath, const string &aQuery, const string &aContentType, const string &aBody)
+{
+  if (
+    apiRequestHandler && !apiPrefix.empty() &&
+    aPath.compare(0, apiPrefix.size(), apiPrefix)==0 &&
+    (aPath.size()==apiPrefix.size() || aPath[apiPrefix.size()]=='/')
+  ) {
+    // API request, wrap into mg44-style JSON
+    JsonObjectPtr request = JsonObject::newObj();
+    request->add("method", JsonObject::newString(aMethod));
+    string uri = aPath.substr(apiPrefix.size());
+    if (uri.empty() || uri[0]!='/') uri.insert(0, "/");
+    request->add("uri", JsonObject::newString(uri));
+    JsonObjectPtr params;
+    addUrlEncodedParams(params, aQuery);
+    if ((aMethod=="POST" || aMethod=="PUT") && !aBody.empty()) {
+      if (aContentType.compare(0, 33, "application/x-www-form-urlencoded")==0) {
+        // form fields are treated like query parameters
+        addUrlEncodedParams(params, aBody);
+      }
+      else {
+        JsonObjectPtr data = JsonObject::objFromText(aBody.c_str(), aBody.size());
+        if (!data) {
+          sendResponse(400, "text/plain", "invalid JSON in request body");
+          return;
+        }
+        request->add("data", data);
+      }
+    }
+    if (params) request->add("uri_params", params);
+    answerPending = true;
+    apiRequestHandler(HttpCommPtr(this), request);
+    return;
+  }
+  if (aMethod!="GET") {
+    sendResponse(405, "text/plain", statusText(405));
+    return;
+  }
+  serveFile(aPath);
+}
+
+
+void HttpComm::serveFile(const string &aPath)
+{
+  if (docRoot.empty()) {
+    sendResponse(404, "text/plain", statusText(404));
+    return;
+  }
+  if (aPath.empty() || aPath[0]!='/' || aPath.find("..")!=string::npos) {
+    sendResponse(403, "text/plain", statusText(403));
+    return;
+  }
+  string path = aPath;
+  if (path[path.size()-1]=='/') path += "index.html";
+  string fn = docRoot + path;
+  // only serve regular files (fopen() succeeds on directories, too)
+  struct stat st;
+  FILE *f = NULL;
+  if (stat(fn.c_str(), &st)==0 && S_ISREG(st.st_mode)) {
+    f = fopen(fn.c_str(), "rb");
+  }
+  if (!f) {
+    LOG(LOG_INFO, "HTTP file not found: %s", fn.c_str());
+    sendResponse(404, "text/plain", statusText(404));
+    return;
+  }
+  string content;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f))>0) {
+    content.append(buf, n);
+  }
+  fclose(f);
+  sendResponse(200, contentTypeFor(path), content);
+}
+
+
+void HttpComm::sendJsonAnswer(JsonObjectPtr aAnswer)
+{
+  if (!answerPending) return; // no request to answer
+  answerPending = false;
+  sendResponse(200, "application/json", aAnswer ? aAnswer->json_str() : "{}");
+  // process further requests that might have arrived in the meantime. As we might be called from
+  // within processRequests(), do it from the mainloop to avoid recursion for every pipelined request
+  if (!receiveBuffer.empty() && processTicket==0) {
+    processTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&HttpComm::processPendingRequests, this));
+  }
+}
+
+
+void HttpComm::processPendingRequests()
+{
+  processTicket = 0;
+  processRequests();
+}
+
+
+void HttpComm::sendResponse(int aStatus, const char *aContentType, const string &aBody)
+{
+  string resp = string_format(
+    "HTTP/1.1 %d %s\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Length: %lu\r\n"
+    "Connection: %s\r\n",
+    aStatus, statusText(aStatus),
+    aContentType,
+    (unsigned long)aBody.size(),
+    keepAlive ? "keep-alive" : "close"
+  );
+  if (aStatus==200 && strcmp(aContentType, "application/json")!=0) {
+    string_format_append(resp, "Cache-Control: max-age=%d\r\n", HTTP_STATIC_MAXAGE);
+  }
+  resp += "\r\n";
+  resp += aBody;
+  if (!keepAlive) closeWhenSent = true;
+  sendRaw(resp);
+}
+
+
+void HttpComm::sendRaw(const string &aData)
+{
+  if (transmitBuffer.empty()) {
+    // nothing buffered, try to send directly
+    ErrorPtr err;
+    size_t sentBytes = transmitBytes(aData.size(), (const uint8_t *)aData.c_str(), err);
+    if (!Error::isOK(err)) {
+      LOG(LOG_DEBUG, "HttpComm: error sending data: %s", err->description().c_str());
+      closeConnection();
+      return;
+    }
+    if (sentBytes<aData.size()) {
+      // remainder must be sent when socket is ready again
+      transmitBuffer.assign(aData, sentBytes, string::npos);
+      setTransmitHandler(boost::bind(&HttpComm::canSendData, this, _1));
+      return;
+    }
+    // all sent
+    if (closeWhenSent) closeConnection();
+  }
+  else {
+    // already sending, just append
+    transmitBuffer.append(aData);
+  }
+}
+
+
+void HttpComm::canSendData(ErrorPtr aError)
+{
+  size_t sentBytes = 0;
+  if (Error::isOK(aError)) {
+    sentBytes = transmitBytes(transmitBuffer.size(), (const uint8_t *)transmitBuffer.c_str(), aError);
+  }
+  if (!Error::isOK(aError)) {
+    LOG(LOG_DEBUG, "HttpComm: error sending data: %s", aError->description().c_str());
+    transmitBuffer.clear();
+    setTransmitHandler(NULL);
+    closeConnection();
+    return;
+  }
+  transmitBuffer.erase(0, sentBytes);
+  if (transmitBuffer.empty()) {
+    // all sent
+    setTransmitHandler(NULL);
+    if (closeWhenSent) closeConnection();
+  }
+}
+
+#endif // !DISABLE_HTTPSERVER
@@ -0,0 +1,103 @@
+//
+//  Copyright (c) 2016 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44sbbd.
+//
+//  p44sbbd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44sbbd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44sbbd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44sbbd__httpcomm__
+#define __p44sbbd__httpcomm__
+
+#include "p44utils_common.hpp"
+
+#include "socketcomm.hpp"
+#include "jsonobject.hpp"
+
+#if !DISABLE_HTTPSERVER
+
+using namespace std;
+
+namespace p44 {
+
+
+  class HttpComm;
+  typedef boost::intrusive_ptr<HttpComm> HttpCommPtr;
+
+  /// callback for API requests
+  /// @param aConnection the connection the request came in on, answer must be sent via sendJsonAnswer()
+  /// @param aRequest the request, wrapped into JSON the same way the mg44 web server does:
+  ///   { "method" : "GET"|"POST"|"PUT", "uri" : "/myuri" [, "uri_params":{ ... }] [, "data" : <JSON payload>] }
+  typedef boost::function<void (HttpCommPtr aConnection, JsonObjectPtr aRequest)> HttpApiRequestCB;
+
+
+  /// minimal HTTP/1.1 server connection with keep-alive, serving mg44-style JSON API requests
+  /// and static files
+  class HttpComm : public SocketComm
+  {
+    typedef SocketComm inherited;
+
+    string docRoot; ///< directory to serve static files from, empty if none
+    string apiPrefix; ///< URI prefix for API requests
+    HttpApiRequestCB apiRequestHandler;
+
+    string receiveBuffer;
+    string transmitBuffer;
+    bool keepAlive; ///< set if connection should be kept open after current response
+    bool answerPending; ///< set while an API request is being processed
+    bool closeWhenSent; ///< set to close connection as soon as transmitBuffer is empty
+    long idleTicket;
+    long processTicket;
+
+  public:
+
+    HttpComm(MainLoop &aMainLoop);
+    virtual ~HttpComm();
+
+    /// set directory to serve static files from
+    /// @param aDocRoot path to the document root, empty to disable serving files
+    void setDocumentRoot(const string &aDocRoot) { docRoot = aDocRoot; };
+
+    /// set handler for API requests
+    /// @param aApiPrefix requests for URIs starting with this prefix are API requests,
+    ///   the remainder of the URI (with leading slash) is passed as "uri" to the handler
+    /// @param aApiRequestHandler the handler
+    void setApiRequestHandler(const string &aApiPrefix, HttpApiRequestCB aApiRequestHandler);
+
+    /// send answer for the API request currently pending
+    /// @param aAnswer the JSON answer
+    void sendJsonAnswer(JsonObjectPtr aAnswer);
+
+  private:
+
+    void gotData(ErrorPtr aError);
+    void canSendData(ErrorPtr aError);
+    void idleTimeout();
+    void processRequests();
+    void processPendingRequests();
+    void handleRequest(const string &aMethod, const string &aPath, const string &aQuery, const string &aContentType, const string &aBody);
+    void serveFile(const string &aPath);
+    void sendResponse(int aStatus, const char *aContentType, const string &aBody);
+    void sendRaw(const string &aData);
+
+  };
+
+
+} // namespace p44
+
+#endif // !DISABLE_HTTPSERVER
+
+#endif /* defined(__p44sbbd__httpcomm__) */
@@ -0,0 +1,438 @@
+//
+//  Copyright (c) 2016 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44sbbd.
+//
+//  p44sbbd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44sbbd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44sbbd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// p44sbbbridge: runs on the device the RS485 bus is physically connected to,
+// and makes it available to a p44sbbd on another host via TCP (see sbbbridge.hpp for the protocol)
+
+#include "application.hpp"
+
+#include "serialcomm.hpp"
+#include "socketcomm.hpp"
+#include "digitalio.hpp"
+#include "sbbbridge.hpp"
+
+#include <termios.h>
+#include <list>
+
+using namespace p44;
+
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+#define DEFAULT_COMMPARAMS "19200,8,N,2"
+
+#define MAINLOOP_CYCLE_TIME_uS 10000 // 10mS
+
+#define BRIDGE_RX_BUFSIZE 256
+#define BRIDGE_COMMAND_GAP (5*MilliSecond) // gap between commands on the bus, same as p44sbbd uses for a local interface
+
+
+class P44SbbBridge : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  SerialCommPtr serial;
+  SocketCommPtr server;
+  SocketCommPtr client; ///< the currently connected p44sbbd, only one at a time
+  SbbBridgeDecoder decoder;
+  string clientTxBuffer; ///< data for p44sbbd not yet accepted by the socket
+
+  // RS485 driver control
+  DigitalIoPtr txEnable;
+  DigitalIoPtr rxEnable;
+  enum {
+    txEnable_none,
+    txEnable_io,
+    txEnable_dtr,
+    txEnable_rts
+  } txEnableMode;
+  MLMicroSeconds txOffDelay;
+  long txOffTicket;
+
+  // serial output, executed in order
+  typedef struct {
+    SbbBridgeControl control; ///< bridgectrl_literal for data
+    string data;
+  } SerialItem;
+  typedef std::list<SerialItem> SerialItemList;
+  SerialItemList serialQueue;
+  long gapTicket; ///< set while waiting for the gap after a command
+
+public:
+
+  P44SbbBridge() :
+    txEnableMode(txEnable_none),
+    txOffDelay(0),
+    txOffTicket(0),
+    gapTicket(0)
+  {
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    const char *usageText =
+      "Usage: %1$s [options]\n";
+    const CmdLineOptionDescriptor options[] = {
+      { 'l', "loglevel",        true,  "level;set max level of log message detail to show on stderr" },
+      { 0  , "rs485connection", true,  "serial_if;RS485 serial interface device (/dev/...)" },
+      { 0  , "commparams",      true,  "params;serial parameters, defaults to " DEFAULT_COMMPARAMS },
+      { 0  , "rs485txenable",   true,  "pinspec;a digital output pin specification for TX driver enable or DTR or RTS" },
+      { 0  , "rs485txoffdelay", true,  "delay;time to keep tx enabled after sending [ms], defaults to 0" },
+      { 0  , "rs485rxenable",   true,  "pinspec;a digital output pin specification for RX driver enable" },
+      { 'p', "port",            true,  "port;TCP port to accept p44sbbd connection on, defaults to 2109" },
+      { 0  , "nonlocal",        false, "allow connection from non-local clients" },
+      { 'h', "help",            false, "show this text" },
+      { 0, NULL } // list terminator
+    };
+
+    // parse the command line, exits when syntax errors occur
+    setCommandDescriptors(usageText, options);
+    parseCommandLine(argc, argv);
+
+    if (numOptions()<1) {
+      // show usage
+      showUsage();
+      terminateApp(EXIT_SUCCESS);
+    }
+
+    // log level?
+    int loglevel = DEFAULT_LOGLEVEL;
+    getIntOption("loglevel", loglevel);
+    SETLOGLEVEL(loglevel);
+    SETERRLEVEL(LOG_ERR, true); // errors and more serious go to stderr, all log goes to stdout
+
+    // app now ready to run
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    ErrorPtr err;
+    // - serial port
+    string s;
+    if (!getStringOption("rs485connection", s)) {
+      terminateAppWith(TextError::err("no RS485 connection specified"));
+      return;
+    }
+    string commparams = DEFAULT_COMMPARAMS;
+    getStringOption("commparams", commparams);
+    serial = SerialCommPtr(new SerialComm(MainLoop::currentMainLoop()));
+    serial->setConnectionSpecification(s.c_str(), 0, commparams.c_str());
+    err = serial->establishConnection();
+    if (!Error::isOK(err)) {
+      terminateAppWith(err);
+      return;
+    }
+    serial->setReceiveHandler(boost::bind(&P44SbbBridge::serialDataReceived, this, _1));
+    // - RS485 driver control
+    string tx,rx;
+    int txoffdelay = 0;
+    getStringOption("rs485txenable", tx);
+    getStringOption("rs485rxenable", rx);
+    getIntOption("rs485txoffdelay", txoffdelay);
+    setRS485DriverControl(tx, rx, txoffdelay*MilliSecond);
+    enableSendingImmediate(false);
+    // - TCP server
+    int port = SBBBRIDGE_DEFAULT_PORT;
+    getIntOption("port", port);
+    server = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    server->setConnectionParams(NULL, string_format("%d", port).c_str(), SOCK_STREAM, AF_INET);
+    server->setAllowNonlocalConnections(getOption("nonlocal"));
+    server->startServer(boost::bind(&P44SbbBridge::clientConnectionHandler, this, _1), 2);
+    LOG(LOG_NOTICE, "Bridging %s to TCP port %d", s.c_str(), port);
+  };
+
+
+  #pragma mark - RS485 driver control
+
+  void setRS485DriverControl(const string &aTxEnablePinSpec, const string &aRxEnablePinSpec, MLMicroSeconds aOffDelay)
+  {
+    txOffDelay = aOffDelay;
+    if (aTxEnablePinSpec.empty()) {
+      txEnableMode = txEnable_none;
+    }
+    else if (aTxEnablePinSpec=="DTR") {
+      txEnableMode = txEnable_dtr;
+    }
+    else if (aTxEnablePinSpec=="RTS") {
+      txEnableMode = txEnable_rts;
+    }
+    else {
+      // digital I/O line
+      txEnableMode = txEnable_io;
+      txEnable = DigitalIoPtr(new DigitalIo(aTxEnablePinSpec.c_str(), true, false));
+      rxEnable = DigitalIoPtr(new DigitalIo(aRxEnablePinSpec.c_str(), true, true));
+    }
+  }
+
+
+  void enableSendingImmediate(bool aEnable)
+  {
+    switch(txEnableMode) {
+      case txEnable_dtr:
+        serial->setDTR(aEnable);
+        return;
+      case txEnable_rts:
+        serial->setRTS(aEnable);
+        return;
+      case txEnable_io:
+        rxEnable->set(!aEnable);
+        txEnable->set(aEnable);
+        return;
+      default:
+        return; // NOP
+    }
+  }
+
+
+  void enableSending(bool aEnable)
+  {
+    MainLoop::currentMainLoop().cancelExecutionTicket(txOffTicket);
+    if (aEnable || txOffDelay==0) {
+      enableSendingImmediate(aEnable);
+    }
+    else {
+      txOffTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44SbbBridge::enableSendingImmediate, this, aEnable), txOffDelay);
+    }
+  }
+
+
+  #pragma mark - TCP side
+
+  SocketCommPtr clientConnectionHandler(SocketCommPtr aServerSocketComm)
+  {
+    SocketCommPtr conn = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    conn->setReceiveHandler(boost::bind(&P44SbbBridge::clientDataReceived, this, conn, _1));
+    conn->setConnectionStatusHandler(boost::bind(&P44SbbBridge::clientStatusHandler, this, _1, _2));
+    conn->setClearHandlersAtClose(); // close must break retain cycles so this object won't cause a mem leak
+    if (client) {
+      LOG(LOG_NOTICE, "New p44sbbd connection replaces previous one");
+      client->closeConnection();
+    }
+    client = conn;
+    decoder.reset();
+    clientTxBuffer.clear();
+    clearSerialQueue();
+    return conn;
+  }
+
+
+  void clientStatusHandler(SocketCommPtr aSocketComm, ErrorPtr aError)
+  {
+    if (aSocketComm==client && (!Error::isOK(aError) || !aSocketComm->connected())) {
+      LOG(LOG_NOTICE, "p44sbbd disconnected");
+      client.reset();
+      clientTxBuffer.clear();
+      clearSerialQueue();
+      enableSending(false);
+    }
+  }
+
+
+  void clientDataReceived(SocketCommPtr aConnection, ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      LOG(LOG_WARNING, "Error receiving from p44sbbd: %s", aError->description().c_str());
+      return;
+    }
+    uint8_t buf[BRIDGE_RX_BUFSIZE];
+    size_t n = aConnection->receiveBytes(sizeof(buf), buf, aError);
+    if (Error::isOK(aError) && n>0) {
+      decoder.decode(n, buf, boost::bind(&P44SbbBridge::queueData, this, _1), boost::bind(&P44SbbBridge::queueControl, this, _1));
+      processSerialQueue();
+    }
+  }
+
+
+  void sendToClient(const string &aData)
+  {
+    if (!client) return; // nobody to send to
+    clientTxBuffer += aData;
+    transmitToClient();
+  }
+
+
+  void transmitToClient()
+  {
+    ErrorPtr err;
+    size_t sent = client->transmitBytes(clientTxBuffer.size(), (const uint8_t *)clientTxBuffer.c_str(), err);
+    if (!Error::isOK(err)) {
+      LOG(LOG_WARNING, "Error sending to p44sbbd: %s", err->description().c_str());
+      clientTxBuffer.clear();
+      client->setTransmitHandler(NULL);
+      return;
+    }
+    clientTxBuffer.erase(0, sent);
+    if (!clientTxBuffer.empty()) {
+      // socket buffer full, continue when it can accept more
+      client->setTransmitHandler(boost::bind(&P44SbbBridge::clientCanSend, this, _1));
+    }
+    else {
+      client->setTransmitHandler(NULL);
+    }
+  }
+
+
+  void clientCanSend(ErrorPtr aError)
+  {
+    if (client) transmitToClient();
+  }
+
+
+  #pragma mark - serial output queue
+
+  void queueData(const string &aData)
+  {
+    if (!serialQueue.empty() && serialQueue.back().control==bridgectrl_literal) {
+      serialQueue.back().data += aData;
+      return;
+    }
+    SerialItem item;
+    item.control = bridgectrl_literal;
+    item.data = aData;
+    serialQueue.push_back(item);
+  }
+
+
+  void queueControl(SbbBridgeControl aControl)
+  {
+    SerialItem item;
+    item.control = aControl;
+    serialQueue.push_back(item);
+  }
+
+
+  void clearSerialQueue()
+  {
+    serialQueue.clear();
+    MainLoop::currentMainLoop().cancelExecutionTicket(gapTicket);
+    serial->setTransmitHandler(NULL);
+  }
+
+
+  void processSerialQueue()
+  {
+    if (gapTicket) return; // gap after previous command still running
+    while (!serialQueue.empty()) {
+      SerialItem &item = serialQueue.front();
+      if (item.control==bridgectrl_literal) {
+        ErrorPtr err;
+        size_t sent = serial->transmitBytes(item.data.size(), (const uint8_t *)item.data.c_str(), err);
+        if (!Error::isOK(err)) {
+          LOG(LOG_ERR, "Error writing to serial: %s", err->description().c_str());
+          clearSerialQueue();
+          enableSending(false);
+          return;
+        }
+        item.data.erase(0, sent);
+        if (!item.data.empty()) {
+          // serial driver buffer full, continue when it can accept more
+          serial->setTransmitHandler(boost::bind(&P44SbbBridge::serialCanSend, this, _1));
+          return;
+        }
+      }
+      else {
+        SbbBridgeControl control = item.control;
+        bridgeControl(control);
+        if (control==bridgectrl_txoff) {
+          // command complete, keep the gap before the next one
+          serialQueue.pop_front();
+          gapTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44SbbBridge::gapDone, this), BRIDGE_COMMAND_GAP);
+          return;
+        }
+      }
+      serialQueue.pop_front();
+    }
+  }
+
+
+  void serialCanSend(ErrorPtr aError)
+  {
+    serial->setTransmitHandler(NULL);
+    processSerialQueue();
+  }
+
+
+  void gapDone()
+  {
+    gapTicket = 0;
+    processSerialQueue();
+  }
+
+
+  void bridgeControl(SbbBridgeControl aControl)
+  {
+    switch (aControl) {
+      case bridgectrl_break:
+        serial->sendBreak();
+        break;
+      case bridgectrl_txon:
+        enableSending(true);
+        break;
+      case bridgectrl_txoff:
+        // wait until all data is out on the line before disabling the driver
+        tcdrain(serial->getFd());
+        enableSending(false);
+        // confirm to p44sbbd that the command is out on the bus
+        {
+          string ack;
+          sbbBridgeAppendControl(ack, bridgectrl_txoff);
+          sendToClient(ack);
+        }
+        break;
+      default:
+        LOG(LOG_WARNING, "Unknown bridge control 0x%02X", aControl);
+        break;
+    }
+  }
+
+
+  #pragma mark - serial side
+
+  void serialDataReceived(ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      LOG(LOG_WARNING, "Error receiving from serial: %s", aError->description().c_str());
+      return;
+    }
+    uint8_t buf[BRIDGE_RX_BUFSIZE];
+    size_t n = serial->receiveBytes(sizeof(buf), buf, aError);
+    if (!Error::isOK(aError) || n==0) return;
+    string out;
+    sbbBridgeAppendData(out, n, buf);
+    sendToClient(out);
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // prevent debug output before application.main scans command line
+  SETLOGLEVEL(LOG_EMERG);
+  SETERRLEVEL(LOG_EMERG, false); // messages, if any, go to stderr
+  // create the mainloop
+  MainLoop::currentMainLoop().setLoopCycleTime(MAINLOOP_CYCLE_TIME_uS);
+  // create app with current mainloop
+  static P44SbbBridge application;
+  // pass control
+  return application.main(argc, argv);
+}
@@ -23,6 +23,14 @@
 
 #include "sbbcomm.hpp"
 #include "jsoncomm.hpp"
+#if !DISABLE_HTTPSERVER
+#include "httpcomm.hpp"
+#endif
+#if !DISABLE_UDPRECEIVER
+#include "udpreceiver.hpp"
+#endif
+
+#include <sys/resource.h>
 #include "utils.hpp"
 
 using namespace p44;
@@ -32,6 +40,12 @@ using namespace p44;
 
 #define MAINLOOP_CYCLE_TIME_uS 33333 // 33mS
 
+#define DEFAULT_HTTP_DOCROOT "/www/p44sbbd"
+#define HTTP_API_PREFIX "/api"
+
+#define EVENT_COALESCE_TIME (100*MilliSecond) // events arriving within this time are coalesced per module
+#define SERVICES_START_TIMEOUT (5*Second) // servers are started after that time at the latest, even if no frame was sent yet
+
 
 typedef struct {
   uint8_t cmd;
@@ -87,6 +101,34 @@ const SBBCmdDesc sbbCmds[] = {
 };
 
 
+static MLMicroSeconds processStartTime = Never; ///< time main() was entered
+
+
+/// @return seconds since the process was started, including loader and static initialisation
+///   where the OS tells us (Linux /proc), otherwise since main() was entered
+static double secondsSinceProcessStart()
+{
+  #ifdef __linux__
+  char stat[1024];
+  double up;
+  FILE *f = fopen("/proc/self/stat", "r");
+  size_t n = f ? fread(stat, 1, sizeof(stat)-1, f) : 0;
+  if (f) fclose(f);
+  stat[n] = 0;
+  f = fopen("/proc/uptime", "r");
+  bool upOk = f && fscanf(f, "%lf", &up)==1;
+  if (f) fclose(f);
+  // starttime is field 22, counted from after the ")" ending the command name (field 2)
+  const char *p = strrchr(stat, ')');
+  unsigned long long starttime;
+  if (upOk && p && sscanf(p+1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &starttime)==1) {
+    return up-(double)starttime/sysconf(_SC_CLK_TCK);
+  }
+  #endif
+  return (double)(MainLoop::now()-processStartTime)/Second;
+}
+
+
 static const char *weekdays[7] = {
   "MO",
   "DI",
@@ -99,6 +141,113 @@ static const char *weekdays[7] = {
 
 
 
+/// a JSON API connection subscribed to the event stream
+/// @note pending events are coalesced: only the latest state per module is kept until sent,
+///   so a slow client never causes more than one pending entry per module
+class ApiSubscriber;
+typedef boost::intrusive_ptr<ApiSubscriber> ApiSubscriberPtr;
+
+class ApiSubscriber : public P44Obj
+{
+public:
+
+  JsonCommPtr connection;
+  typedef std::map<int, JsonObjectPtr> ModuleEventMap;
+  ModuleEventMap moduleEvents; ///< pending (not yet sent) state per module
+  JsonObjectPtr busEvent; ///< pending bus health state
+  string transmitBuffer; ///< output not yet accepted by the socket
+  bool failed; ///< set when sending failed, owner must drop this subscriber
+
+  ApiSubscriber(JsonCommPtr aConnection) : connection(aConnection), failed(false) {};
+
+  /// @return pending state object for given module, created if none pending yet
+  JsonObjectPtr moduleEvent(int aModuleAddr)
+  {
+    JsonObjectPtr &m = moduleEvents[aModuleAddr];
+    if (!m) {
+      m = JsonObject::newObj();
+      m->add("addr", JsonObject::newInt32(aModuleAddr));
+    }
+    return m;
+  };
+
+  /// send message on the subscribed connection
+  /// @note once subscribed, all output to the connection must go through here, so
+  ///   we know when the client has consumed everything we sent so far
+  void sendMessage(JsonObjectPtr aMessage)
+  {
+    if (failed) return;
+    transmitBuffer += aMessage->json_str();
+    transmitBuffer += "\n";
+    transmitPending();
+  };
+
+  /// send pending events, if any, but only if client has consumed all previous output.
+  /// Otherwise, events keep coalescing per module and are sent when output has drained.
+  void flush()
+  {
+    if (failed || !transmitBuffer.empty()) return; // broken, or client still busy with previous output
+    if (moduleEvents.empty() && !busEvent) return;
+    JsonObjectPtr msg = JsonObject::newObj();
+    msg->add("event", JsonObject::newString("update"));
+    if (!moduleEvents.empty()) {
+      JsonObjectPtr modules = JsonObject::newArray();
+      for (ModuleEventMap::iterator pos = moduleEvents.begin(); pos!=moduleEvents.end(); ++pos) {
+        modules->arrayAppend(pos->second);
+      }
+      msg->add("modules", modules);
+      moduleEvents.clear();
+    }
+    if (busEvent) {
+      msg->add("bushealth", busEvent);
+      busEvent.reset();
+    }
+    sendMessage(msg);
+  };
+
+private:
+
+  void transmitPending()
+  {
+    ErrorPtr err;
+    size_t n = connection->transmitBytes(transmitBuffer.size(), (const uint8_t *)transmitBuffer.c_str(), err);
+    if (!Error::isOK(err)) {
+      // Note: do not close the connection here, this would remove us from the subscriber list while still running
+      LOG(LOG_WARNING, "Error sending to event stream client: %s", err->description().c_str());
+      transmitBuffer.clear();
+      connection->setTransmitHandler(NULL);
+      failed = true;
+      return;
+    }
+    transmitBuffer.erase(0, n);
+    if (transmitBuffer.empty()) {
+      connection->setTransmitHandler(NULL);
+    }
+    else {
+      // wait for socket to accept more
+      connection->setTransmitHandler(boost::bind(&ApiSubscriber::canSend, ApiSubscriberPtr(this), _1));
+    }
+  };
+
+  void canSend(ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      connection->setTransmitHandler(NULL);
+      failed = true;
+      return;
+    }
+    transmitPending();
+    if (transmitBuffer.empty()) {
+      // client has drained, deliver what has accumulated meanwhile
+      flush();
+    }
+  };
+
+};
+typedef std::list<ApiSubscriberPtr> ApiSubscriberList;
+
+
+
 class P44sbbd : public CmdLineApp
 {
   typedef CmdLineApp inherited;
@@ -108,6 +257,23 @@ class P44sbbd : public CmdLineApp
   bool apiMode; ///< set if in API mode (means working as daemon, not quitting when job is done)
   // API Server
   SocketCommPtr apiServer;
+  ApiSubscriberList subscribers; ///< connections subscribed to the event stream
+  long eventFlushTicket;
+  #if !DISABLE_HTTPSERVER
+  // built-in HTTP server
+  SocketCommPtr httpServer;
+  string httpDocRoot;
+  #endif
+  #if !DISABLE_UDPRECEIVER
+  // binary UDP updates
+  SbbUdpReceiverPtr udpReceiver;
+  #endif
+
+  // startup
+  bool startupStats;
+  bool startupFailureLogged;
+  bool servicesStarted;
+  long servicesTicket;
 
   string statedir;
 
@@ -125,6 +291,11 @@ public:
 
   P44sbbd() :
     apiMode(false),
+    eventFlushTicket(0),
+    startupStats(false),
+    startupFailureLogged(false),
+    servicesStarted(false),
+    servicesTicket(0),
     initiateTicket(0),
     clockEnabled(false),
     hourmodule(-1),
@@ -144,13 +315,26 @@ public:
       { 'l', "loglevel",        true,  "level;set max level of log message detail to show on stderr" },
       { 'W', "jsonapiport",     true,  "port;server port number for JSON API" },
       { 0  , "jsonapinonlocal", false, "allow connection to JSON API from non-local clients" },
-      { 0  , "rs485connection", true,  "serial_if;RS485 serial interface where display is connected (/device or IP:port)" },
+      #if !DISABLE_HTTPSERVER
+      { 0  , "httpport",        true,  "port;server port number for built-in HTTP server (JSON API at " HTTP_API_PREFIX ", static files)" },
+      { 0  , "httpnonlocal",    false, "allow connection to HTTP server from non-local clients" },
+      { 0  , "httpdocroot",     true,  "path;directory with static files to serve via HTTP. Defaults to " DEFAULT_HTTP_DOCROOT },
+      #endif
+      #if !DISABLE_UDPRECEIVER
+      { 0  , "udpport",         true,  "port;UDP port number for receiving compact binary module updates" },
+      { 0  , "udpnonlocal",     false, "allow binary UDP updates from non-local senders" },
+      #endif
+      { 0  , "rs485connection", true,  "serial_if;RS485 serial interface where display is connected (/device, IP:port or bridge:IP:port for p44sbbbridge)" },
       { 0  , "rs485txenable",   true,  "pinspec;a digital output pin specification for TX driver enable or DTR or RTS" },
       { 0  , "rs485txoffdelay", true,  "delay;time to keep tx enabled after sending [ms], defaults to 0" },
       { 0  , "rs485rxenable",   true,  "pinspec;a digital output pin specification for RX driver enable" },
+      { 0  , "maxrotating",     true,  "count;max number of modules allowed to rotate at the same time (power budget), defaults to 0=unlimited" },
+      { 0  , "flaptime",        true,  "time;motor time per flap [ms] for power budget calculation, defaults to 70" },
+      { 0  , "verify",          false, "read back module positions after writing and re-send on mismatch" },
       { 0  , "timedisplay",     true,  "hourmodule,minutemodule;module addresses to be used for time display" },
       { 0  , "weekdaydisplay",  true,  "firstchar[,secondchar];module addresses to be used for weekday display" },
       { 0  , "statedir",        true,  "path;writable directory where to store state information. Defaults to " DEFAULT_STATE_DIR },
+      { 0  , "startupstats",    false, "log time from process start (main() entry on non-Linux) to first command sent and peak memory usage" },
       { 'h', "help",            false, "show this text" },
       { 0, NULL } // list terminator
     };
@@ -171,6 +355,8 @@ public:
     SETLOGLEVEL(loglevel);
     SETERRLEVEL(LOG_ERR, true); // errors and more serious go to stderr, all log goes to stdout
 
+    startupStats = getOption("startupstats");
+
     // state dir
     statedir = DEFAULT_STATE_DIR;
     getStringOption("statedir", statedir);
@@ -189,26 +375,25 @@ public:
     string s;
     if (getStringOption("rs485connection", s)) {
       sbbComm = SbbCommPtr(new SbbComm(MainLoop::currentMainLoop()));
-      sbbComm->setConnectionSpecification(s.c_str(), 2109);
+      sbbComm->setConnectionSpecification(s.c_str(), SBBBRIDGE_DEFAULT_PORT);
       string tx,rx;
       int txoffdelay = 0;
       getStringOption("rs485txenable", tx);
       getStringOption("rs485rxenable", rx);
       getIntOption("rs485txoffdelay", txoffdelay);
       sbbComm->setRS485DriverControl(tx.c_str(), rx.c_str(), txoffdelay*MilliSecond);
+      int maxrotating = 0;
+      int flaptime = 70;
+      getIntOption("maxrotating", maxrotating);
+      getIntOption("flaptime", flaptime);
+      sbbComm->setPowerBudget(maxrotating, flaptime*MilliSecond);
+      sbbComm->setVerification(getOption("verify"));
+      sbbComm->setEventHandler(boost::bind(&P44sbbd::sbbEventHandler, this, _1, _2, _3, _4));
     }
     else {
       terminateAppWith(TextError::err("no RS485 connection specified"));
       return;
     }
-    // - start API server and wait for things to happen
-    string apiport;
-    if (getStringOption("jsonapiport", apiport)) {
-      apiServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
-      apiServer->setConnectionParams(NULL, apiport.c_str(), SOCK_STREAM, AF_INET);
-      apiServer->setAllowNonlocalConnections(getOption("jsonapinonlocal"));
-      apiServer->startServer(boost::bind(&P44sbbd::apiConnectionHandler, this, _1), 3);
-    }
     // - check for clock
     if (getStringOption("timedisplay", s)) {
       sscanf(s.c_str(), "%d,%d", &hourmodule, &minutemodule);
@@ -222,11 +407,55 @@ public:
       // schedule update
       clockTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44sbbd::clockUpdate, this));
     }
+    // - servers are started only when the first frame is out on the bus, or after a timeout
+    //   if there is no clock frame to send or the bus does not respond
+    servicesTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44sbbd::startServices, this), clockEnabled ? SERVICES_START_TIMEOUT : 0);
 //    // start status polling
 //    statusPoll();
   };
 
 
+  void startServices()
+  {
+    if (servicesStarted) return;
+    servicesStarted = true;
+    MainLoop::currentMainLoop().cancelExecutionTicket(servicesTicket);
+    ErrorPtr err;
+    // - start API server
+    string apiport;
+    if (getStringOption("jsonapiport", apiport)) {
+      apiServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+      apiServer->setConnectionParams(NULL, apiport.c_str(), SOCK_STREAM, AF_INET);
+      apiServer->setAllowNonlocalConnections(getOption("jsonapinonlocal"));
+      apiServer->startServer(boost::bind(&P44sbbd::apiConnectionHandler, this, _1), 3);
+    }
+    #if !DISABLE_HTTPSERVER
+    // - start built-in HTTP server
+    string httpport;
+    if (getStringOption("httpport", httpport)) {
+      httpDocRoot = DEFAULT_HTTP_DOCROOT;
+      getStringOption("httpdocroot", httpDocRoot);
+      httpServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+      httpServer->setConnectionParams(NULL, httpport.c_str(), SOCK_STREAM, AF_INET);
+      httpServer->setAllowNonlocalConnections(getOption("httpnonlocal"));
+      httpServer->startServer(boost::bind(&P44sbbd::httpConnectionHandler, this, _1), 10);
+    }
+    #endif
+    #if !DISABLE_UDPRECEIVER
+    // - start binary UDP update receiver
+    int udpport;
+    if (getIntOption("udpport", udpport)) {
+      udpReceiver = SbbUdpReceiverPtr(new SbbUdpReceiver(MainLoop::currentMainLoop(), sbbComm));
+      err = udpReceiver->start(udpport, getOption("udpnonlocal"));
+      if (!Error::isOK(err)) {
+        LOG(LOG_ERR, "Cannot start UDP receiver: %s", err->description().c_str());
+        udpReceiver.reset();
+      }
+    }
+    #endif
+  }
+
+
   void cleanup(int aExitCode)
   {
     // clean up
@@ -240,20 +469,21 @@ public:
       struct tm t;
       time_t tim = time(NULL);
       localtime_r(&tim, &t);
-      // update clock display
+      // update clock display, all modules in one frame
       if (hourmodule>=0) {
-        sbbComm->setModuleValue(hourmodule, moduletype_hour, t.tm_hour);
+        sbbComm->stageModuleValue(hourmodule, moduletype_hour, t.tm_hour);
       }
       if (minutemodule>=0) {
-        sbbComm->setModuleValue(minutemodule, moduletype_minute, t.tm_min);
+        sbbComm->stageModuleValue(minutemodule, moduletype_minute, t.tm_min);
       }
       if (weekday1module>=0) {
         // need weekday
-        sbbComm->setModuleValue(weekday1module, moduletype_alphanum, weekdays[t.tm_wday][0]);
+        sbbComm->stageModuleValue(weekday1module, moduletype_alphanum, weekdays[t.tm_wday][0]);
         if (weekday2module) {
-          sbbComm->setModuleValue(weekday2module, moduletype_alphanum, weekdays[t.tm_wday][1]);
+          sbbComm->stageModuleValue(weekday2module, moduletype_alphanum, weekdays[t.tm_wday][1]);
         }
       }
+      sbbComm->commitFrame();
       // schedule next update
       clockTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44sbbd::clockUpdate, this), (60-t.tm_sec)*Second);
     }
@@ -274,41 +504,224 @@ public:
   void apiRequestHandler(JsonCommPtr aConnection, ErrorPtr aError, JsonObjectPtr aRequest)
   {
     ErrorPtr err;
-    JsonObjectPtr answer = JsonObject::newObj();
-    // Decode mg44-style request (HTTP wrapped in JSON)
+    JsonObjectPtr answer;
     if (Error::isOK(aError)) {
-      LOG(LOG_INFO,"API request: %s", aRequest->c_strValue());
-      JsonObjectPtr o;
-      o = aRequest->get("method");
-      if (o) {
-        string method = o->stringValue();
-        string uri;
-        o = aRequest->get("uri");
-        if (o) uri = o->stringValue();
-        JsonObjectPtr data;
-        bool action = (method!="GET");
-        if (action) {
-          data = aRequest->get("data");
+      answer = mg44Request(aRequest, aConnection);
+    }
+    else {
+      LOG(LOG_ERR,"Invalid JSON request");
+      answer = JsonObject::newObj();
+      answer->add("Error", JsonObject::newString(aError->description()));
+    }
+    LOG(LOG_INFO,"API answer: %s", answer->c_strValue());
+    ApiSubscriberPtr s = findSubscriber(aConnection);
+    if (s) {
+      // subscribed: answer goes through subscriber's output buffer
+      s->sendMessage(answer);
+      if (s->failed) dropSubscriber(s);
+    }
+    else {
+      // not subscribed: one request per connection
+      err = aConnection->sendMessage(answer);
+      aConnection->closeAfterSend();
+    }
+  }
+
+
+  #if !DISABLE_HTTPSERVER
+
+  SocketCommPtr httpConnectionHandler(SocketCommPtr aServerSocketComm)
+  {
+    HttpCommPtr conn = HttpCommPtr(new HttpComm(MainLoop::currentMainLoop()));
+    conn->setDocumentRoot(httpDocRoot);
+    conn->setApiRequestHandler(HTTP_API_PREFIX, boost::bind(&P44sbbd::httpApiRequestHandler, this, _1, _2));
+    conn->setClearHandlersAtClose(); // close must break retain cycles so this object won't cause a mem leak
+    return conn;
+  }
+
+
+  void httpApiRequestHandler(HttpCommPtr aConnection, JsonObjectPtr aRequest)
+  {
+    // no event stream subscriptions via HTTP, so no connection to pass
+    JsonObjectPtr answer = mg44Request(aRequest, JsonCommPtr());
+    LOG(LOG_INFO,"HTTP API answer: %s", answer->c_strValue());
+    aConnection->sendJsonAnswer(answer);
+  }
+
+  #endif // !DISABLE_HTTPSERVER
+
+
+  /// process mg44-style request (HTTP wrapped in JSON)
+  /// @param aRequest the request
+  /// @param aConnection the JSON API connection the request came from, NULL if none (HTTP)
+  /// @return answer
+  JsonObjectPtr mg44Request(JsonObjectPtr aRequest, JsonCommPtr aConnection)
+  {
+    JsonObjectPtr answer = JsonObject::newObj();
+    LOG(LOG_INFO,"API request: %s", aRequest->c_strValue());
+    JsonObjectPtr o;
+    o = aRequest->get("method");
+    if (o) {
+      string method = o->stringValue();
+      string uri;
+      o = aRequest->get("uri");
+      if (o) uri = o->stringValue();
+      JsonObjectPtr data;
+      bool action = (method!="GET");
+      if (action) {
+        data = aRequest->get("data");
+      }
+      else {
+        data = aRequest->get("uri_params");
+        if (data) action = true; // GET, but with query_params: treat like PUT/POST with data
+      }
+      // request elements now: uri and data
+      if (uri=="/events" || uri=="events") {
+        // subscribe this connection to the event stream
+        if (aConnection) {
+          answer->add("result", subscribeEvents(aConnection));
         }
         else {
-          data = aRequest->get("uri_params");
-          if (data) action = true; // GET, but with query_params: treat like PUT/POST with data
+          answer->add("Error", JsonObject::newString("event stream only available on JSON API port"));
         }
-        // request elements now: uri and data
+      }
+      else {
         JsonObjectPtr r = processRequest(uri, data, action);
         if (r) answer->add("result", r);
       }
     }
-    else {
-      LOG(LOG_ERR,"Invalid JSON request");
-      answer->add("Error", JsonObject::newString(aError->description()));
+    return answer;
+  }
+
+
+  #pragma mark - event stream
+
+  ApiSubscriberPtr findSubscriber(SocketCommPtr aConnection)
+  {
+    for (ApiSubscriberList::iterator pos = subscribers.begin(); pos!=subscribers.end(); ++pos) {
+      if ((*pos)->connection==aConnection) return *pos;
     }
-    LOG(LOG_INFO,"API answer: %s", answer->c_strValue());
-    err = aConnection->sendMessage(answer);
-    aConnection->closeAfterSend();
+    return ApiSubscriberPtr();
   }
 
 
+  JsonObjectPtr subscribeEvents(JsonCommPtr aConnection)
+  {
+    if (!findSubscriber(aConnection)) {
+      LOG(LOG_NOTICE, "API client subscribed to event stream");
+      subscribers.push_back(ApiSubscriberPtr(new ApiSubscriber(aConnection)));
+      aConnection->setConnectionStatusHandler(boost::bind(&P44sbbd::subscriberStatusHandler, this, _1, _2));
+    }
+    JsonObjectPtr r = JsonObject::newObj();
+    r->add("subscribed", JsonObject::newBool(true));
+    r->add("bushealth", JsonObject::newString(SbbComm::busHealthText(sbbComm->getBusHealth())));
+    return r;
+  }
+
+
+  void dropSubscriber(ApiSubscriberPtr aSubscriber)
+  {
+    LOG(LOG_NOTICE, "Dropping API event stream client after send error");
+    subscribers.remove(aSubscriber);
+    aSubscriber->connection->closeConnection();
+  }
+
+
+  void subscriberStatusHandler(SocketCommPtr aSocketComm, ErrorPtr aError)
+  {
+    if (!Error::isOK(aError) || !aSocketComm->connected()) {
+      ApiSubscriberPtr s = findSubscriber(aSocketComm);
+      if (s) {
+        LOG(LOG_NOTICE, "API event stream client disconnected");
+        subscribers.remove(s);
+      }
+    }
+  }
+
+
+  void sbbEventHandler(SbbEventType aEvent, int aModuleAddr, int aValue, ErrorPtr aError)
+  {
+    if (aModuleAddr>=0 && (aEvent==sbbevent_commandcomplete || aEvent==sbbevent_commanderror)) {
+      // a command has been sent
+      if (startupStats) {
+        if (aEvent==sbbevent_commandcomplete) {
+          startupStats = false;
+          struct rusage ru;
+          getrusage(RUSAGE_SELF, &ru);
+          #ifdef __APPLE__
+          long maxrss = ru.ru_maxrss/1024; // bytes on macOS
+          #else
+          long maxrss = ru.ru_maxrss; // kB on Linux
+          #endif
+          LOG(LOG_NOTICE,
+            "Startup stats: first command sent %.3f seconds after process start, peak RSS = %ld kB",
+            secondsSinceProcessStart(), maxrss
+          );
+        }
+        else if (!startupFailureLogged) {
+          // no time to first frame to report as long as nothing gets out on the bus
+          startupFailureLogged = true;
+          LOG(LOG_NOTICE,
+            "Startup stats: first command failed %.3f seconds after process start (%s), waiting for first successful one",
+            secondsSinceProcessStart(), aError ? aError->description().c_str() : "unknown error"
+          );
+        }
+      }
+      if (!servicesStarted) {
+        startServices();
+      }
+    }
+    if (subscribers.empty()) return; // nobody interested
+    for (ApiSubscriberList::iterator pos = subscribers.begin(); pos!=subscribers.end(); ++pos) {
+      ApiSubscriberPtr s = *pos;
+      if (aEvent==sbbevent_bushealth) {
+        s->busEvent = JsonObject::newString(SbbComm::busHealthText((SbbBusHealth)aValue));
+      }
+      else if (aModuleAddr>=0) {
+        JsonObjectPtr m = s->moduleEvent(aModuleAddr);
+        switch (aEvent) {
+          case sbbevent_position:
+            m->add("pos", JsonObject::newInt32(aValue));
+            m->add("status", JsonObject::newString("pending"));
+            break;
+          case sbbevent_commandcomplete:
+            m->add("status", JsonObject::newString("ok"));
+            m->del("error"); // earlier error (e.g. before a retry) is no longer relevant
+            break;
+          case sbbevent_commanderror:
+            m->add("status", JsonObject::newString("error"));
+            m->add("error", JsonObject::newString(aError ? aError->description() : "unknown"));
+            break;
+          default:
+            break;
+        }
+      }
+    }
+    if (eventFlushTicket==0) {
+      eventFlushTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&P44sbbd::flushEvents, this), EVENT_COALESCE_TIME);
+    }
+  }
+
+
+  void flushEvents()
+  {
+    eventFlushTicket = 0;
+    // iterate over a copy, as closing connections modifies the subscriber list
+    ApiSubscriberList subs = subscribers;
+    for (ApiSubscriberList::iterator pos = subs.begin(); pos!=subs.end(); ++pos) {
+      ApiSubscriberPtr s = *pos;
+      if (!s->connection->connected()) {
+        // lost connection without status callback
+        subscribers.remove(s);
+        continue;
+      }
+      s->flush();
+      if (s->failed) dropSubscriber(s);
+    }
+  }
+
+
+
   void statusPoll()
   {
     string statuscmd = "\xFF\xD9";
@@ -329,11 +742,7 @@ public:
 
   void setPosition(int aModuleAddr, int aPosition)
   {
-    // create command
-    string poscmd = "\xFF\xC0";
-    poscmd += (char)aModuleAddr;
-    poscmd += (char)aPosition;
-    sbbComm->sendRawCommand(poscmd, 0, NULL);
+    sbbComm->setModulePosition(aModuleAddr, aPosition);
   }
 
 
@@ -368,7 +777,7 @@ public:
     JsonObjectPtr o;
     if (aUri.size()>0 && aUri[0]=='/') aUri.erase(0, 1); // remove trailing slash if there is one
     if (aUri=="interface") {
-      if (aIsAction) {
+      if (aIsAction && aData) {
         if (aData->get("sendbytes", o)) {
           if (o->isType(json_type_string)) {
             // hex string of bytes
@@ -388,7 +797,7 @@ public:
       }
     }
     else if (aUri=="module") {
-      if (aIsAction) {
+      if (aIsAction && aData) {
         if (aData->get("addr", o)) {
           int moduleAddr = o->int32Value();
           if (aData->get("pos", o)) {
@@ -402,6 +811,30 @@ public:
         }
       }
     }
+    else if (aUri=="frame") {
+      if (aIsAction && aData) {
+        // set multiple modules at once
+        // { "modules" : [ { "addr":<addr>, "pos":<position> } | { "addr":<addr>, "char":"<character>" }, ... ] }
+        if (aData->get("modules", o) && o->isType(json_type_array)) {
+          for (int i=0; i<o->arrayLength(); i++) {
+            JsonObjectPtr m = o->arrayGet(i);
+            JsonObjectPtr a, v;
+            if (!m->get("addr", a)) continue;
+            if (m->get("pos", v)) {
+              sbbComm->stageModulePosition(a->int32Value(), v->int32Value());
+            }
+            else if (m->get("char", v)) {
+              string c = v->stringValue();
+              sbbComm->stageModuleValue(a->int32Value(), moduletype_alphanum, c.empty() ? ' ' : c[0]);
+            }
+          }
+          sbbComm->commitFrame();
+        }
+        else {
+          err = WebError::webErr(400, "missing 'modules' array");
+        }
+      }
+    }
     else {
       err = WebError::webErr(500, "Unknown URI");
     }
@@ -420,6 +853,7 @@ public:
 
 int main(int argc, char **argv)
 {
+  processStartTime = MainLoop::now();
   // prevent debug output before application.main scans command line
   SETLOGLEVEL(LOG_EMERG);
   SETERRLEVEL(LOG_EMERG, false); // messages, if any, go to stderr
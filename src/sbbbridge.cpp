@@ -0,0 +1,76 @@
+//
+//  Copyright (c) 2016 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44sbbd.
+//
+//  p44sbbd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44sbbd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44sbbd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "sbbbridge.hpp"
+
+using namespace p44;
+
+
+void p44::sbbBridgeAppendData(string &aStream, size_t aNumBytes, const uint8_t *aBytes)
+{
+  for (size_t i=0; i<aNumBytes; i++) {
+    aStream += (char)aBytes[i];
+    if (aBytes[i]==SBBBRIDGE_ESC) aStream += (char)bridgectrl_literal;
+  }
+}
+
+
+void p44::sbbBridgeAppendControl(string &aStream, SbbBridgeControl aControl)
+{
+  aStream += (char)SBBBRIDGE_ESC;
+  aStream += (char)aControl;
+}
+
+
+SbbBridgeDecoder::SbbBridgeDecoder() :
+  escPending(false)
+{
+}
+
+
+void SbbBridgeDecoder::decode(size_t aNumBytes, const uint8_t *aBytes, DataCB aDataCB, ControlCB aControlCB)
+{
+  string data;
+  for (size_t i=0; i<aNumBytes; i++) {
+    uint8_t b = aBytes[i];
+    if (escPending) {
+      escPending = false;
+      if (b==bridgectrl_literal) {
+        data += (char)SBBBRIDGE_ESC;
+      }
+      else {
+        // control: deliver data so far first to keep order
+        if (!data.empty()) {
+          aDataCB(data);
+          data.clear();
+        }
+        if (aControlCB) aControlCB((SbbBridgeControl)b);
+      }
+    }
+    else if (b==SBBBRIDGE_ESC) {
+      escPending = true;
+    }
+    else {
+      data += (char)b;
+    }
+  }
+  if (!data.empty()) aDataCB(data);
+}
@@ -0,0 +1,94 @@
+//
+//  Copyright (c) 2016 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44sbbd.
+//
+//  p44sbbd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44sbbd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44sbbd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44sbbd__sbbbridge__
+#define __p44sbbd__sbbbridge__
+
+#include "p44utils_common.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  // RS485 bridge protocol
+  //
+  // The TCP stream between p44sbbd and p44sbbbridge carries the serial data bytes as-is,
+  // except for SBBBRIDGE_ESC, which introduces a two-byte sequence:
+  //
+  //   ESC 00  : literal SBBBRIDGE_ESC data byte
+  //   ESC 01  : send BREAK on the serial line
+  //   ESC 02  : enable RS485 transmitter
+  //   ESC 03  : disable RS485 transmitter (after all preceding data has been sent)
+  //
+  // From bridge to p44sbbd, data (with escaped SBBBRIDGE_ESC) is sent, plus ESC 03 as a
+  // confirmation each time the transmitter has been disabled after a command, i.e. when
+  // the command is completely out on the bus. p44sbbd completes send-only commands only then.
+
+  #define SBBBRIDGE_ESC 0xFE
+  #define SBBBRIDGE_DEFAULT_PORT 2109
+
+  typedef enum {
+    bridgectrl_literal = 0x00, ///< literal ESC byte (not a control)
+    bridgectrl_break = 0x01, ///< send BREAK
+    bridgectrl_txon = 0x02, ///< enable transmitter
+    bridgectrl_txoff = 0x03 ///< disable transmitter
+  } SbbBridgeControl;
+
+
+  /// append data bytes to a bridge protocol stream
+  /// @param aStream the stream to append to
+  /// @param aNumBytes number of data bytes
+  /// @param aBytes the data bytes
+  void sbbBridgeAppendData(string &aStream, size_t aNumBytes, const uint8_t *aBytes);
+
+  /// append control marker to a bridge protocol stream
+  /// @param aStream the stream to append to
+  /// @param aControl the control marker
+  void sbbBridgeAppendControl(string &aStream, SbbBridgeControl aControl);
+
+
+  /// decoder for bridge protocol streams
+  class SbbBridgeDecoder
+  {
+    bool escPending; ///< set if last byte of previous chunk was ESC
+
+  public:
+
+    typedef boost::function<void (const string &aData)> DataCB;
+    typedef boost::function<void (SbbBridgeControl aControl)> ControlCB;
+
+    SbbBridgeDecoder();
+
+    /// decode a chunk of a bridge protocol stream
+    /// @param aNumBytes number of bytes in chunk
+    /// @param aBytes the bytes
+    /// @param aDataCB called with decoded data
+    /// @param aControlCB called for control markers, in order with the data (can be NULL to ignore controls)
+    void decode(size_t aNumBytes, const uint8_t *aBytes, DataCB aDataCB, ControlCB aControlCB);
+
+    /// reset decoder state (e.g. for a new connection)
+    void reset() { escPending = false; };
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44sbbd__sbbbridge__) */
@@ -24,6 +24,9 @@
 #include "consolekey.hpp"
 #include "application.hpp"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 using namespace p44;
 
 #define SBB_COMMPARAMS "19200,8,N,2"
@@ -33,10 +36,33 @@ using namespace p44;
 
 #define SBB_SYNCBYTE 0xFF // all commands start with this
 
+#define SBB_BRIDGE_PREFIX "bridge:" // connection spec prefix for p44sbbbridge connections
+#define SBB_BRIDGE_ACK_TIMEOUT (2*Second) // max time to wait for the bridge to confirm the oldest command sent to it
+#define SBB_BRIDGE_RX_BUFSIZE 256 // receive buffer size for data from bridge
+
 #define SBB_CMD_SETPOS 0xC0 // set position
 #define SBB_CMD_GETPOS 0xD0 // get position
 #define SBB_CMD_GETSERIAL 0xDF // get serial number
 
+#define SBB_DEGRADED_ERRORS 1 // number of consecutive errors to consider bus degraded
+#define SBB_FAILED_ERRORS 5 // number of consecutive errors to consider bus failed
+
+#define SBB_FRAME_START_DELAY (0.2*Second) // delay before first command of a frame
+#define SBB_FRAME_BURST_DELAY (5*MilliSecond) // delay between commands within a frame
+#define SBB_FRAME_TIMEOUT (10*Second) // a burst not confirmed within that time is considered done anyway
+
+#define SBB_DEFAULT_FLAPS 62 // number of flaps assumed for modules of unknown type
+#define SBB_DEFAULT_FLAP_TIME (70*MilliSecond) // default motor time per flap
+
+#define SBB_VERIFY_SETTLE_TIME (500*MilliSecond) // extra time after estimated end of rotation before reading back position
+#define SBB_VERIFY_MAX_RETRIES 3 // max number of times a position is re-sent after failed verification
+#define SBB_VERIFY_READ_TIMEOUT (300*MilliSecond) // answer timeout for position readback (a module answers within a few ms, if at all)
+#define SBB_VERIFY_MAX_NOANSWER 3 // after that many unanswered readbacks in a row, a module is only spot-checked
+#define SBB_RELIABILITY_STEP 10 // reliability gained per successful verification
+#define SBB_RELIABILITY_MAX 100 // max reliability score
+#define SBB_RELIABILITY_THRESHOLD 50 // modules with this or higher reliability are considered healthy
+#define SBB_VERIFY_SPOTCHECK 10 // healthy modules are verified every Nth write only
+
 
 
 #pragma mark - SbbComm
@@ -45,13 +71,31 @@ SbbComm::SbbComm(MainLoop &aMainLoop) :
 	inherited(aMainLoop),
   txOffDelay(0),
   txEnableMode(txEnable_none),
-  txOffTicket(0)
+  txOffTicket(0),
+  busHealth(bushealth_ok),
+  consecutiveErrors(0),
+  frameCommandsInFlight(0),
+  frameBurstStarted(Never),
+  staggerTicket(0),
+  maxRotating(0),
+  flapTime(SBB_DEFAULT_FLAP_TIME),
+  verifyEnabled(false),
+  bridgeMode(false),
+  bridgeFlushTicket(0),
+  bridgeAckTicket(0),
+  frameBurstDelay(SBB_FRAME_BURST_DELAY)
 {
 }
 
 
 SbbComm::~SbbComm()
 {
+  MainLoop::currentMainLoop().cancelExecutionTicket(staggerTicket);
+  MainLoop::currentMainLoop().cancelExecutionTicket(bridgeFlushTicket);
+  MainLoop::currentMainLoop().cancelExecutionTicket(bridgeAckTicket);
+  for (TicketMap::iterator pos = verifyTickets.begin(); pos!=verifyTickets.end(); ++pos) {
+    MainLoop::currentMainLoop().cancelExecutionTicket(pos->second);
+  }
 }
 
 
@@ -62,13 +106,31 @@ void SbbComm::setConnectionSpecification(const char *aConnectionSpec, uint16_t a
     // simulation mode
   }
   else {
+    // explicit prefix selects connection to a p44sbbbridge, otherwise device path or raw TCP
+    bridgeMode = strncmp(aConnectionSpec, SBB_BRIDGE_PREFIX, strlen(SBB_BRIDGE_PREFIX))==0;
+    if (bridgeMode) aConnectionSpec += strlen(SBB_BRIDGE_PREFIX);
     serialComm->setConnectionSpecification(aConnectionSpec, aDefaultPort, SBB_COMMPARAMS);
-    // we need a non-standard transmitter
-    setTransmitter(boost::bind(&SbbComm::sbbTransmitter, this, _1, _2));
+    if (bridgeMode) {
+      // BREAK and TX enable are sent in-band, and p44sbbbridge keeps the gap between commands on the bus
+      setTransmitter(boost::bind(&SbbComm::bridgeTransmitter, this, _1, _2));
+      serialComm->setReceiveHandler(boost::bind(&SbbComm::bridgeDataReceived, this, _1));
+      frameBurstDelay = 0;
+    }
+    else {
+      // we need a non-standard transmitter
+      setTransmitter(boost::bind(&SbbComm::sbbTransmitter, this, _1, _2));
+    }
+    #if !SBB_LAZY_CONNECT
     // open connection so we can receive from start
     if (serialComm->requestConnection()) {
-      serialComm->setRTS(false); // not sending
+      if (bridgeMode)
+        bridgeConnectionOpened();
+      else
+        serialComm->setRTS(false); // not sending
     }
+    #else
+    // Note: connection is opened lazily by the transmitter when the first command is sent
+    #endif
 //    // set accept buffer for re-assembling messages before processing
 //    setAcceptBuffer(100); // we don't know yet how long SBB messages can get
   }
@@ -129,8 +191,12 @@ void SbbComm::enableSending(bool aEnable)
 size_t SbbComm::sbbTransmitter(size_t aNumBytes, const uint8_t *aBytes)
 {
   ssize_t res = 0;
+  bool wasConnected = serialComm->connectionIsOpen();
   ErrorPtr err = serialComm->establishConnection();
   if (Error::isOK(err)) {
+    if (!wasConnected && txEnableMode!=txEnable_rts) {
+      serialComm->setRTS(false); // opening the port might have asserted RTS
+    }
     if (LOGENABLED(LOG_NOTICE)) {
       string m;
       for (size_t i=0; i<aNumBytes; i++) {
@@ -148,6 +214,7 @@ size_t SbbComm::sbbTransmitter(size_t aNumBytes, const uint8_t *aBytes)
     enableSending(false);
   }
   else {
+    // Note: no updateBusHealth() here, the operation will fail and be counted in sbbCommandComplete()
     LOG(LOG_DEBUG, "SbbComm::sbbTransmitter error - connection could not be established!");
   }
   return res;
@@ -155,9 +222,159 @@ size_t SbbComm::sbbTransmitter(size_t aNumBytes, const uint8_t *aBytes)
 
 
 
+#pragma mark - remote RS485 bridge
+
+size_t SbbComm::bridgeTransmitter(size_t aNumBytes, const uint8_t *aBytes)
+{
+  bool wasConnected = serialComm->connectionIsOpen();
+  ErrorPtr err = serialComm->establishConnection();
+  if (!Error::isOK(err)) {
+    // Note: no updateBusHealth() here, the operation will fail and be counted in sbbCommandComplete()
+    LOG(LOG_DEBUG, "SbbComm::bridgeTransmitter error - connection could not be established!");
+    return 0;
+  }
+  if (!wasConnected) {
+    bridgeConnectionOpened();
+  }
+  if (LOGENABLED(LOG_NOTICE)) {
+    string m;
+    for (size_t i=0; i<aNumBytes; i++) {
+      string_format_append(m, " %02X", aBytes[i]);
+    }
+    LOG(LOG_NOTICE, "transmitting bytes via bridge:%s", m.c_str());
+  }
+  bool flushPending = !bridgeTxBuffer.empty();
+  sbbBridgeAppendControl(bridgeTxBuffer, bridgectrl_txon);
+  sbbBridgeAppendControl(bridgeTxBuffer, bridgectrl_break);
+  sbbBridgeAppendData(bridgeTxBuffer, aNumBytes, aBytes);
+  sbbBridgeAppendControl(bridgeTxBuffer, bridgectrl_txoff);
+  // the bridge confirms each TX-off, i.e. when the command is completely out on the bus.
+  // Completion, if any, is attached by sbbCommandComplete() right after this transmitter returns
+  if (bridgeAcks.empty()) {
+    MainLoop::currentMainLoop().cancelExecutionTicket(bridgeAckTicket);
+    bridgeAckTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&SbbComm::bridgeAckTimeout, this), SBB_BRIDGE_ACK_TIMEOUT);
+  }
+  bridgeAcks.push_back(NULL);
+  // all commands transmitted in this mainloop cycle go out in a single write
+  if (!flushPending) {
+    bridgeFlushTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&SbbComm::flushBridgeBuffer, this));
+  }
+  return aNumBytes;
+}
+
+
+void SbbComm::bridgeConnectionOpened()
+{
+  // we coalesce writes ourselves, so Nagle would only add latency
+  int one = 1;
+  setsockopt(serialComm->getFd(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  bridgeDecoder.reset();
+  // commands sent over a previous connection will never be confirmed
+  failBridgeAcks(TextError::err("bridge connection was re-opened"));
+}
+
+
+void SbbComm::flushBridgeBuffer()
+{
+  bridgeFlushTicket = 0;
+  if (bridgeTxBuffer.empty()) return;
+  ErrorPtr err;
+  size_t sent = serialComm->transmitBytes(bridgeTxBuffer.size(), (const uint8_t *)bridgeTxBuffer.c_str(), err);
+  if (!Error::isOK(err)) {
+    LOG(LOG_WARNING, "SbbComm: error writing to bridge: %s", err->description().c_str());
+    bridgeTxBuffer.clear();
+    serialComm->setTransmitHandler(NULL);
+    serialComm->closeConnection();
+    // Note: failing commands count towards bus health in finishCommand()
+    failBridgeAcks(err);
+    return;
+  }
+  bridgeTxBuffer.erase(0, sent);
+  if (!bridgeTxBuffer.empty()) {
+    // socket buffer full, continue when it can accept more
+    serialComm->setTransmitHandler(boost::bind(&SbbComm::bridgeCanSend, this, _1));
+  }
+  else {
+    serialComm->setTransmitHandler(NULL);
+  }
+}
+
+
+void SbbComm::bridgeCanSend(ErrorPtr aError)
+{
+  flushBridgeBuffer();
+}
+
+
+void SbbComm::bridgeControlDecoded(SbbBridgeControl aControl)
+{
+  if (aControl!=bridgectrl_txoff) return; // only TX-off confirmations are sent upstream
+  if (bridgeAcks.empty()) {
+    LOG(LOG_WARNING, "SbbComm: unexpected confirmation from bridge");
+    return;
+  }
+  BridgeAckCB cb = bridgeAcks.front();
+  bridgeAcks.pop_front();
+  MainLoop::currentMainLoop().cancelExecutionTicket(bridgeAckTicket);
+  if (!bridgeAcks.empty()) {
+    bridgeAckTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&SbbComm::bridgeAckTimeout, this), SBB_BRIDGE_ACK_TIMEOUT);
+  }
+  if (cb) cb(ErrorPtr());
+}
+
+
+void SbbComm::bridgeAckTimeout()
+{
+  bridgeAckTicket = 0;
+  LOG(LOG_WARNING, "SbbComm: bridge did not confirm %lu commands in time", (unsigned long)bridgeAcks.size());
+  failBridgeAcks(TextError::err("command not confirmed by bridge"));
+}
+
+
+void SbbComm::failBridgeAcks(ErrorPtr aError)
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(bridgeAckTicket);
+  // completions might send new commands, so take the list out first
+  BridgeAckList acks;
+  acks.swap(bridgeAcks);
+  for (BridgeAckList::iterator pos = acks.begin(); pos!=acks.end(); ++pos) {
+    if (*pos) (*pos)(aError);
+  }
+}
+
+
+void SbbComm::bridgeDataReceived(ErrorPtr aError)
+{
+  if (!Error::isOK(aError)) {
+    LOG(LOG_WARNING, "SbbComm: error receiving from bridge: %s", aError->description().c_str());
+    return;
+  }
+  uint8_t buf[SBB_BRIDGE_RX_BUFSIZE];
+  size_t n = serialComm->receiveBytes(sizeof(buf), buf, aError);
+  if (Error::isOK(aError) && n>0) {
+    bridgeDecoder.decode(n, buf, boost::bind(&SbbComm::bridgeDataDecoded, this, _1), boost::bind(&SbbComm::bridgeControlDecoded, this, _1));
+  }
+}
+
+
+void SbbComm::bridgeDataDecoded(const string &aData)
+{
+  // pass on to operation queue as if received directly from the serial line
+  acceptBytes(aData.size(), (uint8_t *)aData.c_str());
+}
+
+
 void SbbComm::sendRawCommand(const string aCommand, size_t aExpectedBytes, SBBResultCB aResultCB, MLMicroSeconds aInitiationDelay)
+{
+  sendCommand(aCommand, aExpectedBytes, aResultCB, aInitiationDelay, false);
+}
+
+
+void SbbComm::sendCommand(const string aCommand, size_t aExpectedBytes, SBBResultCB aResultCB, MLMicroSeconds aInitiationDelay, bool aReadback)
 {
   LOG(LOG_INFO, "Posting command (size=%d)", aCommand.size());
+  // commands are SYNC,CMD,ADDR[,params]
+  int moduleAddr = aCommand.size()>=3 && (uint8_t)aCommand[0]==SBB_SYNCBYTE ? (uint8_t)aCommand[2] : -1;
   SerialOperationSendPtr req = SerialOperationSendPtr(new SerialOperationSend);
   req->setDataSize(aCommand.size());
   req->appendData(aCommand.size(), (uint8_t *)aCommand.c_str());
@@ -165,13 +382,13 @@ void SbbComm::sendRawCommand(const string aCommand, size_t aExpectedBytes, SBBRe
   if (aExpectedBytes>0) {
     // we expect some answer bytes
     SerialOperationReceivePtr resp = SerialOperationReceivePtr(new SerialOperationReceive);
-    resp->setCompletionCallback(boost::bind(&SbbComm::sbbCommandComplete, this, aResultCB, resp, _1));
+    resp->setCompletionCallback(boost::bind(&SbbComm::sbbCommandComplete, this, aResultCB, moduleAddr, aReadback, resp, _1));
     resp->setExpectedBytes(aExpectedBytes);
-    resp->setTimeout(2*Second);
+    resp->setTimeout(aReadback ? SBB_VERIFY_READ_TIMEOUT : 2*Second);
     req->setChainedOperation(resp);
   }
   else {
-    req->setCompletionCallback(boost::bind(&SbbComm::sbbCommandComplete, this, aResultCB, SerialOperationPtr(), _1));
+    req->setCompletionCallback(boost::bind(&SbbComm::sbbCommandComplete, this, aResultCB, moduleAddr, aReadback, SerialOperationPtr(), _1));
   }
   queueSerialOperation(req);
   // process operations
@@ -179,7 +396,19 @@ void SbbComm::sendRawCommand(const string aCommand, size_t aExpectedBytes, SBBRe
 }
 
 
-void SbbComm::sbbCommandComplete(SBBResultCB aResultCB, SerialOperationPtr aSerialOperation, ErrorPtr aError)
+void SbbComm::sbbCommandComplete(SBBResultCB aResultCB, int aModuleAddr, bool aReadback, SerialOperationPtr aSerialOperation, ErrorPtr aError)
+{
+  if (bridgeMode && !aSerialOperation && Error::isOK(aError) && !bridgeAcks.empty()) {
+    // send-only command, but data is only on its way to the bridge yet: complete when the bridge confirms
+    // it is out on the bus. The command's entry is the last one, the transmitter has just added it.
+    bridgeAcks.back() = boost::bind(&SbbComm::finishCommand, this, aResultCB, aModuleAddr, aReadback, aSerialOperation, _1);
+    return;
+  }
+  finishCommand(aResultCB, aModuleAddr, aReadback, aSerialOperation, aError);
+}
+
+
+void SbbComm::finishCommand(SBBResultCB aResultCB, int aModuleAddr, bool aReadback, SerialOperationPtr aSerialOperation, ErrorPtr aError)
 {
   LOG(LOG_INFO, "Command complete");
   string result;
@@ -188,12 +417,61 @@ void SbbComm::sbbCommandComplete(SBBResultCB aResultCB, SerialOperationPtr aSeri
     if (resp) {
       result.assign((char *)resp->getDataP(), resp->getDataSize());
     }
+    if (!aReadback) postEvent(sbbevent_commandcomplete, aModuleAddr, 0);
   }
+  else {
+    if (!aReadback) postEvent(sbbevent_commanderror, aModuleAddr, 0, aError);
+  }
+  // a readback not answered is a module problem (verifyAnswer() deals with it), not a bus problem
+  if (!aReadback || Error::isOK(aError)) updateBusHealth(Error::isOK(aError));
   if (aResultCB) aResultCB(result, aError);
 }
 
 
-void SbbComm::setModuleValue(uint8_t aModuleAddr, SbbModuleType aType, uint8_t aValue)
+#pragma mark - events and bus health
+
+void SbbComm::postEvent(SbbEventType aEvent, int aModuleAddr, int aValue, ErrorPtr aError)
+{
+  if (eventHandler) {
+    eventHandler(aEvent, aModuleAddr, aValue, aError);
+  }
+}
+
+
+void SbbComm::updateBusHealth(bool aSuccess)
+{
+  if (aSuccess) {
+    consecutiveErrors = 0;
+  }
+  else {
+    consecutiveErrors++;
+  }
+  SbbBusHealth h = bushealth_ok;
+  if (consecutiveErrors>=SBB_FAILED_ERRORS) h = bushealth_failed;
+  else if (consecutiveErrors>=SBB_DEGRADED_ERRORS) h = bushealth_degraded;
+  if (h!=busHealth) {
+    busHealth = h;
+    LOG(h==bushealth_ok ? LOG_NOTICE : LOG_WARNING, "SBB bus health changed to: %s", busHealthText(busHealth));
+    postEvent(sbbevent_bushealth, -1, busHealth);
+  }
+}
+
+
+const char *SbbComm::busHealthText(SbbBusHealth aBusHealth)
+{
+  switch (aBusHealth) {
+    case bushealth_ok: return "ok";
+    case bushealth_degraded: return "degraded";
+    case bushealth_failed: return "failed";
+  }
+  return "unknown";
+}
+
+
+#pragma mark - module positioning
+
+
+uint8_t SbbComm::positionForValue(SbbModuleType aType, uint8_t aValue)
 {
   uint8_t pos;
   switch (aType) {
@@ -240,13 +518,288 @@ void SbbComm::setModuleValue(uint8_t aModuleAddr, SbbModuleType aType, uint8_t a
       pos = aValue;
       break;
   }
-  string poscmd = "\xFF\xC0";
-  poscmd += (char)aModuleAddr;
-  poscmd += (char)pos;
-  sendRawCommand(poscmd, 0, NULL);
+  return pos;
+}
+
+
+void SbbComm::setModuleValue(uint8_t aModuleAddr, SbbModuleType aType, uint8_t aValue)
+{
+  stageModuleValue(aModuleAddr, aType, aValue);
+  commitFrame();
+}
+
+
+void SbbComm::setModulePosition(uint8_t aModuleAddr, uint8_t aPosition)
+{
+  stageModulePosition(aModuleAddr, aPosition);
+  commitFrame();
+}
+
+
+#pragma mark - frames
+
+void SbbComm::stageModuleValue(uint8_t aModuleAddr, SbbModuleType aType, uint8_t aValue)
+{
+  moduleFlaps[aModuleAddr] = flapsForType(aType);
+  stageModulePosition(aModuleAddr, positionForValue(aType, aValue));
+}
+
+
+void SbbComm::stageModulePosition(uint8_t aModuleAddr, uint8_t aPosition)
+{
+  backFrame[aModuleAddr] = aPosition;
+  // new position requested, previous verification retries no longer apply
+  verifyRetries.erase(aModuleAddr);
+}
+
+
+void SbbComm::commitFrame()
+{
+  if (backFrame.empty()) return;
+  // merge into committed frame, superseding not yet sent positions of the same modules
+  for (SbbFrame::iterator pos = backFrame.begin(); pos!=backFrame.end(); ++pos) {
+    SbbFrame::iterator unsent = sendingFrame.find(pos->first);
+    if (unsent!=sendingFrame.end()) {
+      // module is still waiting for power budget in the current frame, just update target
+      unsent->second = pos->second;
+    }
+    else {
+      committedFrame[pos->first] = pos->second;
+    }
+    postEvent(sbbevent_position, pos->first, pos->second);
+  }
+  backFrame.clear();
+  sendCommittedFrame();
+}
+
+
+void SbbComm::sendCommittedFrame()
+{
+  if (frameCommandsInFlight>0 && MainLoop::now()>frameBurstStarted+SBB_FRAME_TIMEOUT) {
+    LOG(LOG_WARNING, "Frame burst did not complete in time, %d commands unconfirmed", frameCommandsInFlight);
+    frameCommandsInFlight = 0;
+  }
+  if (frameCommandsInFlight>0 || !sendingFrame.empty() || committedFrame.empty()) return; // previous frame still going on, or nothing to send
+  // swap buffers: committed frame goes to the wire, new commits collect in an empty committed frame
+  sendingFrame.swap(committedFrame);
+  LOG(LOG_INFO, "Sending frame with %lu module positions", (unsigned long)sendingFrame.size());
+  frameBurstStarted = MainLoop::now();
+  sendFrameCommands(true);
+}
+
+
+int SbbComm::rotatingModules(MLMicroSeconds &aNextFree)
+{
+  MLMicroSeconds now = MainLoop::now();
+  int rotating = 0;
+  aNextFree = Never;
+  ModuleTimeMap::iterator rpos = rotatingUntil.begin();
+  while (rpos!=rotatingUntil.end()) {
+    if (rpos->second<=now) {
+      // finished, forget
+      rotatingUntil.erase(rpos++);
+      continue;
+    }
+    rotating++;
+    if (aNextFree==Never || rpos->second<aNextFree) aNextFree = rpos->second;
+    ++rpos;
+  }
+  return rotating;
+}
+
+
+void SbbComm::sendFrameCommands(bool aNewFrame)
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(staggerTicket);
+  MLMicroSeconds now = MainLoop::now();
+  MLMicroSeconds nextFree;
+  int rotating = rotatingModules(nextFree);
+  // send as many commands as power budget allows
+  // Note: only a new frame gets the start delay, later passes continue the burst
+  bool first = aNewFrame;
+  SbbFrame::iterator pos = sendingFrame.begin();
+  while (pos!=sendingFrame.end()) {
+    MLMicroSeconds motorTime = estimatedMotorTime(pos->first, pos->second);
+    if (motorTime>0 && maxRotating>0 && rotating>=maxRotating) {
+      // no budget left for this module now, maybe others don't need to rotate
+      ++pos;
+      continue;
+    }
+    MLMicroSeconds delay = first ? SBB_FRAME_START_DELAY : frameBurstDelay;
+    if (motorTime>0) {
+      // occupies budget from now on. Actual end of rotation is only known when the command
+      // has been sent, until then assume the worst case
+      rotatingUntil[pos->first] = now+SBB_FRAME_TIMEOUT;
+      rotating++;
+    }
+    modulePositions[pos->first] = pos->second;
+    string poscmd;
+    poscmd += (char)SBB_SYNCBYTE;
+    poscmd += (char)SBB_CMD_SETPOS;
+    poscmd += (char)pos->first;
+    poscmd += (char)pos->second;
+    frameCommandsInFlight++;
+    sendRawCommand(poscmd, 0, boost::bind(&SbbComm::frameCommandComplete, this, pos->first, pos->second, motorTime, _1, _2), delay);
+    first = false;
+    sendingFrame.erase(pos++);
+  }
+  if (!sendingFrame.empty()) {
+    // rest of frame must wait until enough motors have stopped
+    // Note: re-evaluated when commands just queued complete, as these will then know their actual end time
+    rotatingModules(nextFree);
+    if (nextFree==Never) nextFree = now;
+    LOG(LOG_INFO, "Power budget exhausted, %lu modules delayed", (unsigned long)sendingFrame.size());
+    staggerTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&SbbComm::sendFrameCommands, this, false), nextFree-now+SBB_FRAME_BURST_DELAY);
+  }
 }
 
 
+MLMicroSeconds SbbComm::estimatedMotorTime(uint8_t aModuleAddr, uint8_t aPosition)
+{
+  int flaps = SBB_DEFAULT_FLAPS;
+  ModuleInfoMap::iterator fpos = moduleFlaps.find(aModuleAddr);
+  if (fpos!=moduleFlaps.end()) flaps = fpos->second;
+  int distance = flaps; // unknown current position: assume worst case
+  ModuleInfoMap::iterator ppos = modulePositions.find(aModuleAddr);
+  if (ppos!=modulePositions.end()) {
+    // flaps only move forward. Positions might be out of range for the assumed number of flaps
+    // (e.g. raw position on a module later used as alphanum), so make sure distance is 0..flaps-1
+    distance = ((int)aPosition-ppos->second) % flaps;
+    if (distance<0) distance += flaps;
+  }
+  return distance*flapTime;
+}
+
+
+void SbbComm::frameCommandComplete(uint8_t aModuleAddr, uint8_t aPosition, MLMicroSeconds aMotorTime, const string &aResponse, ErrorPtr aError)
+{
+  if (frameCommandsInFlight>0) frameCommandsInFlight--;
+  if (verifyEnabled && Error::isOK(aError)) {
+    // command is out on the bus now, verify after the motor should have stopped
+    scheduleVerification(aModuleAddr, aPosition, aMotorTime);
+  }
+  if (aMotorTime>0) {
+    if (Error::isOK(aError)) {
+      // command is out on the bus now, motor runs from here
+      rotatingUntil[aModuleAddr] = MainLoop::now()+aMotorTime;
+    }
+    else {
+      // command did not get out, module does not rotate
+      rotatingUntil.erase(aModuleAddr);
+    }
+  }
+  if (!sendingFrame.empty()) {
+    // rest of frame is waiting for power budget, re-plan with the now known rotation end time
+    sendFrameCommands(false);
+  }
+  else if (frameCommandsInFlight==0) {
+    // burst done, send what was committed in the meantime
+    sendCommittedFrame();
+  }
+}
+
+
+void SbbComm::setPowerBudget(int aMaxRotating, MLMicroSeconds aFlapTime)
+{
+  maxRotating = aMaxRotating;
+  flapTime = aFlapTime;
+}
+
+
+#pragma mark - verification
+
+void SbbComm::setVerification(bool aEnable)
+{
+  verifyEnabled = aEnable;
+}
+
+
+void SbbComm::scheduleVerification(uint8_t aModuleAddr, uint8_t aPosition, MLMicroSeconds aSettleTime)
+{
+  // modules not yet proven reliable are always verified, reliable ones and those
+  // that do not answer readbacks at all only every SBB_VERIFY_SPOTCHECK writes
+  int &writes = writesSinceVerify[aModuleAddr];
+  writes++;
+  ModuleInfoMap::iterator rpos = moduleReliability.find(aModuleAddr);
+  int reliability = rpos==moduleReliability.end() ? 0 : rpos->second;
+  ModuleInfoMap::iterator npos = verifyNoAnswer.find(aModuleAddr);
+  bool silent = npos!=verifyNoAnswer.end() && npos->second>=SBB_VERIFY_MAX_NOANSWER;
+  if ((reliability>=SBB_RELIABILITY_THRESHOLD || silent) && writes<SBB_VERIFY_SPOTCHECK) return; // no need to verify this time
+  writes = 0;
+  long &ticket = verifyTickets[aModuleAddr];
+  MainLoop::currentMainLoop().cancelExecutionTicket(ticket);
+  ticket = MainLoop::currentMainLoop().executeOnce(boost::bind(&SbbComm::verifyModule, this, aModuleAddr, aPosition), aSettleTime+SBB_VERIFY_SETTLE_TIME);
+}
+
+
+void SbbComm::verifyModule(uint8_t aModuleAddr, uint8_t aPosition)
+{
+  verifyTickets.erase(aModuleAddr);
+  if (modulePositions[aModuleAddr]!=aPosition) return; // superseded by a newer position in the meantime
+  string rdbcmd;
+  rdbcmd += (char)SBB_SYNCBYTE;
+  rdbcmd += (char)SBB_CMD_GETPOS;
+  rdbcmd += (char)aModuleAddr;
+  // readback: no command events, verifyAnswer() reports the outcome
+  sendCommand(rdbcmd, 1, boost::bind(&SbbComm::verifyAnswer, this, aModuleAddr, aPosition, _1, _2), 0.2*Second, true);
+}
+
+
+void SbbComm::verifyAnswer(uint8_t aModuleAddr, uint8_t aPosition, const string &aResponse, ErrorPtr aError)
+{
+  if (modulePositions[aModuleAddr]!=aPosition) return; // superseded by a newer position in the meantime
+  int &reliability = moduleReliability[aModuleAddr];
+  int &retries = verifyRetries[aModuleAddr];
+  int &noAnswer = verifyNoAnswer[aModuleAddr];
+  if (!Error::isOK(aError) || aResponse.size()<1) {
+    // no answer: says nothing about the position, and re-sending would not help verifying it
+    noAnswer++;
+    if (noAnswer==SBB_VERIFY_MAX_NOANSWER) {
+      LOG(LOG_WARNING, "Module %d: does not answer position readbacks, will only spot-check it from now on", aModuleAddr);
+    }
+    else {
+      LOG(LOG_INFO, "Module %d: cannot read back position: %s", aModuleAddr, aError ? aError->description().c_str() : "no answer");
+    }
+    return;
+  }
+  noAnswer = 0;
+  if ((uint8_t)aResponse[0]==aPosition) {
+    // position confirmed
+    reliability += SBB_RELIABILITY_STEP;
+    if (reliability>SBB_RELIABILITY_MAX) reliability = SBB_RELIABILITY_MAX;
+    retries = 0;
+    LOG(LOG_DEBUG, "Module %d: position %d verified, reliability now %d", aModuleAddr, aPosition, reliability);
+    return;
+  }
+  // not confirmed: module is considered unreliable from now on
+  reliability = 0;
+  LOG(LOG_WARNING, "Module %d: readback position %d does not match expected %d", aModuleAddr, (uint8_t)aResponse[0], aPosition);
+  // base motor time estimate for retry on actual position
+  modulePositions[aModuleAddr] = (uint8_t)aResponse[0];
+  if (retries<SBB_VERIFY_MAX_RETRIES) {
+    retries++;
+    LOG(LOG_NOTICE, "Module %d: re-sending position %d (retry %d)", aModuleAddr, aPosition, retries);
+    backFrame[aModuleAddr] = aPosition; // not via stageModulePosition(), which would reset retries
+    commitFrame();
+  }
+  else {
+    LOG(LOG_ERR, "Module %d: position %d could not be set after %d retries", aModuleAddr, aPosition, retries);
+    retries = 0;
+    postEvent(sbbevent_commanderror, aModuleAddr, aPosition, TextError::err("position %d not confirmed by module", aPosition));
+  }
+}
+
+
+int SbbComm::flapsForType(SbbModuleType aType)
+{
+  switch (aType) {
+    case moduletype_minute:
+    case moduletype_62:
+      return 62;
+    default:
+      return 40;
+  }
+}
 
 
 
@@ -26,6 +26,9 @@
 
 #include "serialqueue.hpp"
 #include "digitalio.hpp"
+#include "sbbbridge.hpp"
+
+#include <list>
 
 using namespace std;
 
@@ -60,6 +63,31 @@ namespace p44 {
   typedef boost::function<void (const string &aResponse, ErrorPtr aError)> SBBResultCB;
 
 
+  typedef enum {
+    sbbevent_position, ///< module was commanded to a new position (value = position)
+    sbbevent_commandcomplete, ///< command to a module completed successfully
+    sbbevent_commanderror, ///< command to a module failed (error passed)
+    sbbevent_bushealth ///< bus health has changed (value = new SbbBusHealth)
+  } SbbEventType;
+
+  typedef enum {
+    bushealth_ok, ///< recent commands completed fine
+    bushealth_degraded, ///< a few recent commands have failed
+    bushealth_failed ///< many consecutive commands have failed, bus is probably not operational
+  } SbbBusHealth;
+
+  /// event callback
+  /// @param aEvent the type of event
+  /// @param aModuleAddr the module address the event relates to, -1 for bus-wide events
+  /// @param aValue event specific value (position, bus health)
+  /// @param aError error for sbbevent_commanderror, NULL otherwise
+  typedef boost::function<void (SbbEventType aEvent, int aModuleAddr, int aValue, ErrorPtr aError)> SbbEventCB;
+
+
+  /// a frame: flap positions for a set of modules, by module address
+  typedef std::map<uint8_t, uint8_t> SbbFrame;
+
+
   typedef boost::intrusive_ptr<SbbComm> SbbCommPtr;
   class SbbComm : public SerialOperationQueue
   {
@@ -76,14 +104,56 @@ namespace p44 {
     MLMicroSeconds txOffDelay;
     long txOffTicket;
 
+    SbbEventCB eventHandler;
+    SbbBusHealth busHealth;
+    int consecutiveErrors;
+
+    SbbFrame backFrame; ///< staged, not yet committed positions
+    SbbFrame committedFrame; ///< committed positions waiting for the bus
+    SbbFrame sendingFrame; ///< positions of the current frame not yet sent (waiting for power budget)
+    int frameCommandsInFlight; ///< number of position commands of the current burst not yet completed
+    MLMicroSeconds frameBurstStarted; ///< when the current burst was started
+    long staggerTicket;
+
+    // power budget
+    typedef std::map<uint8_t, int> ModuleInfoMap;
+    typedef std::map<uint8_t, MLMicroSeconds> ModuleTimeMap;
+    int maxRotating; ///< max number of modules rotating at the same time, 0=unlimited
+    MLMicroSeconds flapTime; ///< motor time per flap
+    ModuleInfoMap moduleFlaps; ///< number of flaps per module, as far as known from module type
+    ModuleInfoMap modulePositions; ///< last position sent per module
+    ModuleTimeMap rotatingUntil; ///< estimated end of rotation (from send completion) for modules currently rotating
+
+    // verification
+    typedef std::map<uint8_t, long> TicketMap;
+    bool verifyEnabled;
+    ModuleInfoMap moduleReliability; ///< reliability score per module, 0=unknown/unreliable
+    ModuleInfoMap writesSinceVerify; ///< number of positions sent since last verification
+    ModuleInfoMap verifyNoAnswer; ///< number of unanswered readbacks in a row
+    ModuleInfoMap verifyRetries; ///< number of retries for current position, reset when a new position is staged
+    TicketMap verifyTickets; ///< pending verifications
+
+    // remote bridge
+    bool bridgeMode; ///< set when connected via TCP to a p44sbbbridge
+    string bridgeTxBuffer; ///< bridge protocol data waiting to be written in one go
+    long bridgeFlushTicket;
+    SbbBridgeDecoder bridgeDecoder;
+    typedef boost::function<void (ErrorPtr aError)> BridgeAckCB;
+    typedef std::list<BridgeAckCB> BridgeAckList;
+    BridgeAckList bridgeAcks; ///< one entry per command sent to the bridge, in order, with the completion to run when the bridge confirms it (NULL if none)
+    long bridgeAckTicket;
+    MLMicroSeconds frameBurstDelay; ///< delay between commands within a frame
+
   public:
 
     SbbComm(MainLoop &aMainLoop);
     virtual ~SbbComm();
 
     /// set the connection parameters to connect to the SBB RS485 bus
-    /// @param aConnectionSpec serial device path (/dev/...) or host name/address[:port] (1.2.3.4 or xxx.yy)
+    /// @param aConnectionSpec serial device path (/dev/...) or host name/address[:port] (1.2.3.4 or xxx.yy),
+    ///   optionally prefixed with "bridge:" for a TCP connection to a p44sbbbridge (see sbbbridge.hpp for the protocol)
     /// @param aDefaultPort default port number for TCP connection (irrelevant for direct serial device connection)
+    /// @note plain TCP connections (without "bridge:") are raw serial-over-TCP, as before
     void setConnectionSpecification(const char *aConnectionSpec, uint16_t aDefaultPort);
 
     /// set the RS485 driver control lines
@@ -99,8 +169,61 @@ namespace p44 {
     /// @param aModuleAddr the module address
     /// @param aType the module type, controls value->position transformation
     /// @param aValue the value to show.
+    /// @note same as stageModuleValue() followed by commitFrame()
     void setModuleValue(uint8_t aModuleAddr, SbbModuleType aType, uint8_t aValue);
 
+    /// set a module to a raw flap position
+    /// @param aModuleAddr the module address
+    /// @param aPosition the flap position (index) to show
+    /// @note same as stageModulePosition() followed by commitFrame()
+    void setModulePosition(uint8_t aModuleAddr, uint8_t aPosition);
+
+    /// stage a value for a module in the back buffer, to be sent with next commitFrame()
+    /// @param aModuleAddr the module address
+    /// @param aType the module type, controls value->position transformation
+    /// @param aValue the value to show.
+    void stageModuleValue(uint8_t aModuleAddr, SbbModuleType aType, uint8_t aValue);
+
+    /// stage a raw flap position for a module in the back buffer, to be sent with next commitFrame()
+    /// @param aModuleAddr the module address
+    /// @param aPosition the flap position (index) to show
+    void stageModulePosition(uint8_t aModuleAddr, uint8_t aPosition);
+
+    /// commit all staged positions at once
+    /// @note staged positions must be committed in the same mainloop cycle, otherwise they might get
+    ///   committed along with other clients' changes.
+    /// @note all positions of a frame are sent as a tight burst. While a burst is still on the bus,
+    ///   further commits are merged, so positions superseded before they could be sent never reach the wire.
+    void commitFrame();
+
+    /// set the power budget for rotating modules
+    /// @param aMaxRotating max number of modules allowed to rotate at the same time, 0=unlimited
+    /// @param aFlapTime motor time needed to advance one flap
+    /// @note rotation times are estimated from the distance between last sent and new position,
+    ///   frame commands exceeding the budget are delayed until enough modules have stopped.
+    void setPowerBudget(int aMaxRotating, MLMicroSeconds aFlapTime);
+
+    /// enable verification of positions by reading them back from the module
+    /// @param aEnable if set, positions sent are read back after the module has settled, and re-sent on mismatch.
+    /// @note modules that have been verified successfully several times are only spot-checked
+    ///   occasionally, while modules with failed verifications are verified on every write.
+    void setVerification(bool aEnable);
+
+    /// @return flap position for a value
+    /// @param aType the module type, controls value->position transformation
+    /// @param aValue the value to show.
+    static uint8_t positionForValue(SbbModuleType aType, uint8_t aValue);
+
+    /// set handler to be informed about module and bus events
+    /// @param aEventCB will be called for position changes, command completions/errors and bus health transitions
+    void setEventHandler(SbbEventCB aEventCB) { eventHandler = aEventCB; };
+
+    /// @return current bus health
+    SbbBusHealth getBusHealth() { return busHealth; };
+
+    /// @return text representation of a bus health value
+    static const char *busHealthText(SbbBusHealth aBusHealth);
+
   protected:
 
     /// called to process extra bytes after all pending operations have processed their bytes
@@ -115,8 +238,32 @@ namespace p44 {
     /// special transmitter
     size_t sbbTransmitter(size_t aNumBytes, const uint8_t *aBytes);
 
-    void sbbCommandComplete(SBBResultCB aStatusCB, SerialOperationPtr aSerialOperation, ErrorPtr aError);
+    /// transmitter for remote bridge
+    size_t bridgeTransmitter(size_t aNumBytes, const uint8_t *aBytes);
+    void bridgeConnectionOpened();
+    void flushBridgeBuffer();
+    void bridgeCanSend(ErrorPtr aError);
+    void bridgeDataReceived(ErrorPtr aError);
+    void bridgeDataDecoded(const string &aData);
+    void bridgeControlDecoded(SbbBridgeControl aControl);
+    void bridgeAckTimeout();
+    void failBridgeAcks(ErrorPtr aError);
+
+    void sendCommand(const string aCommand, size_t aExpectedBytes, SBBResultCB aResultCB, MLMicroSeconds aInitiationDelay, bool aReadback);
+    void sbbCommandComplete(SBBResultCB aStatusCB, int aModuleAddr, bool aReadback, SerialOperationPtr aSerialOperation, ErrorPtr aError);
+    void finishCommand(SBBResultCB aStatusCB, int aModuleAddr, bool aReadback, SerialOperationPtr aSerialOperation, ErrorPtr aError);
     void enableSendingImmediate(bool aEnable);
+    void postEvent(SbbEventType aEvent, int aModuleAddr, int aValue, ErrorPtr aError = ErrorPtr());
+    void updateBusHealth(bool aSuccess);
+    void sendCommittedFrame();
+    void frameCommandComplete(uint8_t aModuleAddr, uint8_t aPosition, MLMicroSeconds aMotorTime, const string &aResponse, ErrorPtr aError);
+    int rotatingModules(MLMicroSeconds &aNextFree);
+    void sendFrameCommands(bool aNewFrame);
+    MLMicroSeconds estimatedMotorTime(uint8_t aModuleAddr, uint8_t aPosition);
+    static int flapsForType(SbbModuleType aType);
+    void scheduleVerification(uint8_t aModuleAddr, uint8_t aPosition, MLMicroSeconds aSettleTime);
+    void verifyModule(uint8_t aModuleAddr, uint8_t aPosition);
+    void verifyAnswer(uint8_t aModuleAddr, uint8_t aPosition, const string &aResponse, ErrorPtr aError);
 
   };
 
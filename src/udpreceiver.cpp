@@ -0,0 +1,135 @@
+//
+//  Copyright (c) 2016 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44sbbd.
+//
+//  p44sbbd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44sbbd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44sbbd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "udpreceiver.hpp"
+
+#if !DISABLE_UDPRECEIVER
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+using namespace p44;
+
+#define SBB_UDP_MAX_PACKET 1500 // max packet size we process, larger ones are truncated (and thus dropped)
+#define SBB_UDP_RESTART_TIME (2*Second) // after that much silence, any sequence number is accepted as the new base
+
+
+SbbUdpReceiver::SbbUdpReceiver(MainLoop &aMainLoop, SbbCommPtr aSbbComm) :
+  inherited(aMainLoop),
+  sbbComm(aSbbComm),
+  seqValid(false),
+  lastSeq(0),
+  lastSeqTime(Never)
+{
+}
+
+
+SbbUdpReceiver::~SbbUdpReceiver()
+{
+  stopMonitoringAndClose();
+}
+
+
+ErrorPtr SbbUdpReceiver::start(uint16_t aPort, bool aNonLocal)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd<0) {
+    return SysError::errNo("cannot create UDP socket: ");
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(aPort);
+  addr.sin_addr.s_addr = htonl(aNonLocal ? INADDR_ANY : INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))<0) {
+    ErrorPtr err = SysError::errNo("cannot bind UDP socket: ");
+    close(fd);
+    return err;
+  }
+  setFd(fd);
+  setReceiveHandler(boost::bind(&SbbUdpReceiver::gotData, this, _1));
+  LOG(LOG_NOTICE, "Listening for binary UDP updates on port %d", aPort);
+  return ErrorPtr();
+}
+
+
+void SbbUdpReceiver::gotData(ErrorPtr aError)
+{
+  if (!Error::isOK(aError)) {
+    LOG(LOG_WARNING, "UDP receive error: %s", aError->description().c_str());
+    return;
+  }
+  // read all datagrams available, into stack buffer (no allocation)
+  uint8_t packet[SBB_UDP_MAX_PACKET];
+  ssize_t n;
+  while ((n = recv(getFd(), packet, sizeof(packet), MSG_DONTWAIT))>0) {
+    processPacket(packet, n);
+  }
+}
+
+
+void SbbUdpReceiver::processPacket(const uint8_t *aPacket, size_t aSize)
+{
+  if (aSize<SBB_UDP_HEADER_SIZE || aPacket[0]!=SBB_UDP_MAGIC || (aSize-SBB_UDP_HEADER_SIZE)%SBB_UDP_ENTRY_SIZE!=0) {
+    LOG(LOG_INFO, "UDP: dropped malformed packet (size=%lu)", (unsigned long)aSize);
+    return;
+  }
+  uint32_t seq =
+    ((uint32_t)aPacket[1]<<24) |
+    ((uint32_t)aPacket[2]<<16) |
+    ((uint32_t)aPacket[3]<<8) |
+    (uint32_t)aPacket[4];
+  MLMicroSeconds now = MainLoop::now();
+  if (seqValid) {
+    // - after a pause, any sequence number is accepted as the new base. This way, a restarted
+    //   sender is picked up even if its first packets got lost, but a delayed or duplicated
+    //   packet cannot reopen the window while the sequence is advancing.
+    bool restart = now>lastSeqTime+SBB_UDP_RESTART_TIME;
+    // - sequence numbers wrap around, so compare as signed difference
+    if (!restart && (int32_t)(seq-lastSeq)<=0) {
+      LOG(LOG_INFO, "UDP: dropped duplicate or out-of-order packet (seq=%u, last=%u)", seq, lastSeq);
+      return;
+    }
+    if (restart && (int32_t)(seq-lastSeq)<=0) {
+      LOG(LOG_NOTICE, "UDP: sequence restarted at %u after pause (last=%u)", seq, lastSeq);
+    }
+  }
+  lastSeq = seq;
+  lastSeqTime = now;
+  seqValid = true;
+  // apply entries, as one frame
+  for (size_t i=SBB_UDP_HEADER_SIZE; i<aSize; i+=SBB_UDP_ENTRY_SIZE) {
+    uint8_t moduleAddr = aPacket[i];
+    uint8_t value = aPacket[i+2];
+    switch ((SbbUdpValueType)aPacket[i+1]) {
+      case udpvalue_position: sbbComm->stageModulePosition(moduleAddr, value); break;
+      case udpvalue_alphanum: sbbComm->stageModuleValue(moduleAddr, moduletype_alphanum, value); break;
+      case udpvalue_hour: sbbComm->stageModuleValue(moduleAddr, moduletype_hour, value); break;
+      case udpvalue_minute: sbbComm->stageModuleValue(moduleAddr, moduletype_minute, value); break;
+      default:
+        LOG(LOG_INFO, "UDP: ignored entry with unknown value type %d for module %d", aPacket[i+1], moduleAddr);
+        break;
+    }
+  }
+  sbbComm->commitFrame();
+}
+
+#endif // !DISABLE_UDPRECEIVER
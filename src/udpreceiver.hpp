@@ -0,0 +1,97 @@
+//
+//  Copyright (c) 2016 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44sbbd.
+//
+//  p44sbbd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44sbbd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44sbbd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44sbbd__udpreceiver__
+#define __p44sbbd__udpreceiver__
+
+#include "p44utils_common.hpp"
+
+#include "fdcomm.hpp"
+#include "sbbcomm.hpp"
+
+#if !DISABLE_UDPRECEIVER
+
+using namespace std;
+
+namespace p44 {
+
+  // Binary UDP update packet format (all multi-byte values big endian):
+  //
+  //  offset  size  content
+  //  ------  ----  -------
+  //  0       1     magic/version byte, SBB_UDP_MAGIC
+  //  1       4     sequence number. Packets with a sequence number not newer than the last
+  //                one accepted are dropped, unless no packet has been accepted for SBB_UDP_RESTART_TIME
+  //                (see udpreceiver.cpp). Then any sequence number is accepted as the new base,
+  //                e.g. from a restarted sender (which may start at any number, usually 0).
+  //  5       3*n   n update entries, each consisting of:
+  //                - module address
+  //                - value type (SbbUdpValueType)
+  //                - value (position or character, depending on type)
+
+  #define SBB_UDP_MAGIC 0xB1
+  #define SBB_UDP_HEADER_SIZE 5
+  #define SBB_UDP_ENTRY_SIZE 3
+
+  typedef enum {
+    udpvalue_position = 0, ///< raw flap position
+    udpvalue_alphanum = 1, ///< character for alphanumeric module
+    udpvalue_hour = 2, ///< hour 0..23
+    udpvalue_minute = 3 ///< minute 0..59
+  } SbbUdpValueType;
+
+
+  class SbbUdpReceiver;
+  typedef boost::intrusive_ptr<SbbUdpReceiver> SbbUdpReceiverPtr;
+
+  /// receives compact binary update packets via UDP and passes them to SbbComm
+  class SbbUdpReceiver : public FdComm
+  {
+    typedef FdComm inherited;
+
+    SbbCommPtr sbbComm;
+    bool seqValid; ///< set when lastSeq is valid
+    uint32_t lastSeq; ///< sequence number of last accepted packet
+    MLMicroSeconds lastSeqTime; ///< when last packet was accepted
+
+  public:
+
+    SbbUdpReceiver(MainLoop &aMainLoop, SbbCommPtr aSbbComm);
+    virtual ~SbbUdpReceiver();
+
+    /// start listening
+    /// @param aPort UDP port number to listen on
+    /// @param aNonLocal if set, packets from other hosts are accepted, otherwise only from localhost
+    /// @return error, if any
+    ErrorPtr start(uint16_t aPort, bool aNonLocal);
+
+  private:
+
+    void gotData(ErrorPtr aError);
+    void processPacket(const uint8_t *aPacket, size_t aSize);
+
+  };
+
+} // namespace p44
+
+#endif // !DISABLE_UDPRECEIVER
+
+#endif /* defined(__p44sbbd__udpreceiver__) */